@@ -1,3 +1,6 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
 #include <iostream>
 #include <string>
 #include <ctime>
@@ -50,6 +53,7 @@ struct IReply
 
 std::string getPostMessage();
 void displayPostMessage(const std::string& sender, const std::string& message, std::time_t& time);
+void displayReConnectionMessage(const std::string& host, const std::string & port);
   
 class IClient
 {
@@ -71,4 +75,4 @@ private:
   void toUpperCase(std::string& str) const;
 };
 
-
+#endif
@@ -1,18 +1,25 @@
 #include <algorithm>
+#include <cstdint>
 #include <cstdio>
 #include <ctime>
 #include<glog/logging.h>
 #include <google/protobuf/timestamp.pb.h>
 #include <google/protobuf/duration.pb.h>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <queue>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <map>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <sstream>
 #include <string>
 #include <thread>
 #include <mutex>
@@ -23,6 +30,11 @@
 
 #include "coordinator.grpc.pb.h"
 #include "coordinator.pb.h"
+#include "failure_detector.h"
+#include "hash_ring.h"
+#include "raft.h"
+#include "state_log.h"
+#include "znode_store.h"
 
 #define log(severity, msg) LOG(severity) << msg; google::FlushLogFiles(google::severity); 
 
@@ -39,97 +51,718 @@ using csce438::CoordService;
 using csce438::ServerInfo;
 using csce438::Confirmation;
 using csce438::ID;
+using csce438::CoordCommand;
+using csce438::WatchRequest;
+using csce438::RoutingUpdate;
+using csce438::WatchEvent;
+using csce438::ClusterRoute;
 using csce438::ServerList;
+using csce438::PathAndData;
+using csce438::Path;
+using csce438::LogRecord;
+using csce438::CoordSnapshot;
+using csce438::ZnodeRecord;
 using csce438::SynchService;
 
+// failure detection settings: the heartbeat interval servers are expected to
+// use, the phi at which a server is declared failed, and a floor on the
+// standard deviation of heartbeat intervals so a very regular server isn't
+// declared failed on the first small delay
+double heartbeat_interval_ms = 250;
+double phi_threshold = 8;
+double min_std_ms = 50;
+
+// commands queued for one server's heartbeat stream
+struct CommandChannel {
+    std::mutex mu;
+    std::condition_variable cv;
+    std::deque<CoordCommand> queue;
+    bool closed = false;
+
+    void push(const CoordCommand& cmd) {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            queue.push_back(cmd);
+        }
+        cv.notify_one();
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            closed = true;
+        }
+        cv.notify_one();
+    }
+
+    bool isClosed() {
+        std::lock_guard<std::mutex> lock(mu);
+        return closed;
+    }
+
+    // blocks until a command is queued; false once the channel is closed
+    bool next(CoordCommand* cmd) {
+        std::unique_lock<std::mutex> lock(mu);
+        cv.wait(lock, [this]{ return closed || !queue.empty(); });
+        if (closed) return false;
+        *cmd = std::move(queue.front());
+        queue.pop_front();
+        return true;
+    }
+};
+
 struct zNode{
+    zNode(int clusterID, int serverID)
+        : clusterID(clusterID), serverID(serverID),
+          detector(heartbeat_interval_ms, min_std_ms), heartbeats(1),
+          missed_heartbeat(false), routed(false) {}
+    int clusterID;
     int serverID;
     std::string hostname;
     std::string port;
     std::string type;
-    std::time_t last_heartbeat;
+    PhiAccrualDetector detector;
+    // heartbeats received so far; lets the detector skip stale deadlines
+    uint64_t heartbeats;
     bool missed_heartbeat;
+    // whether the published routing table lists this server
+    bool routed;
+    // set while the server has a heartbeat stream open
+    std::shared_ptr<CommandChannel> commands;
     bool isActive();
+    ServerInfo info() const;
 };
 
-//potentially thread safe 
-std::mutex v_mutex;
-std::vector<zNode*> cluster1;
-std::vector<zNode*> cluster2;
-std::vector<zNode*> cluster3;
+// registry key: cluster ID in the high 32 bits, server ID in the low 32 bits
+typedef uint64_t ServerKey;
 
-// creating a vector of vectors containing znodes
-std::vector<std::vector<zNode*>> clusters = {cluster1, cluster2, cluster3};
+inline ServerKey serverKey(int clusterID, int serverID) {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(clusterID)) << 32) | static_cast<uint32_t>(serverID);
+}
+
+// guards registry and clusters
+std::mutex v_mutex;
+// every known server, so a heartbeat finds its zNode in O(1)
+std::unordered_map<ServerKey, zNode*> registry;
+// servers of each cluster in registration order, used for routing clients
+std::map<int, std::vector<zNode*>> clusters;
+// current master of each cluster
+std::map<int, ServerKey> masters;
+
+// virtual nodes per cluster on the user placement ring
+int ring_vnodes = 100;
+
+// immutable snapshot of the active servers in each cluster. GetServer reads
+// the current snapshot without taking v_mutex; writers build a new one and
+// swap it in whenever membership or liveness changes.
+struct RoutingTable {
+    uint64_t version = 0;
+    // places users on every cluster that has registered, whether or not it
+    // currently has an active server, so an outage doesn't move users
+    HashRing ring{ring_vnodes};
+    // every active server of each cluster
+    std::map<int, std::vector<ServerInfo>> clusters;
+    // servers clients may be sent to: the master, or every active server
+    // while the cluster has none. only the master's changes are replicated,
+    // so clients are never sent to a slave alongside it
+    std::map<int, std::vector<ServerInfo>> routes;
+};
+std::shared_ptr<const RoutingTable> routing_table = std::make_shared<const RoutingTable>();
+// znodes served by create/exists. a server's ephemeral nodes live as long as
+// its heartbeat session, whose id is its ServerKey
+ZnodeStore znodes;
+
+// registry and znode changes are logged under data_dir so a restarted
+// coordinator can route right away. writes happen with v_mutex held
+std::string data_dir = ".";
+size_t snapshot_every = 10000;
+// how long a restored server has to heartbeat again before it is failed
+int restart_grace_ms = 2000;
+StateLog state_log;
+
+// replicated mode: the coordinators listed with -c replicate the registry and
+// znode tree with Raft instead of the state log. only the leader takes
+// heartbeats and writes, any of them answers reads
+std::unique_ptr<RaftNode> raft;
+// reads are refused once this node may be further behind than this
+int max_staleness_ms = 500;
+// Watch handlers wait on watch_cv for a new routing table version
+std::mutex watch_mutex;
+std::condition_variable watch_cv;
+
+
+// pending failure deadlines, earliest first. every heartbeat pushes a new
+// deadline; an entry whose heartbeat count is out of date is simply dropped
+// when it reaches the top, so nodes are never scanned
+struct Deadline {
+    PhiAccrualDetector::Clock::time_point when;
+    ServerKey key;
+    uint64_t heartbeats;
+    bool operator>(const Deadline& d) const { return when > d.when; }
+};
+std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline>> deadlines;
+// wakes the detector when a deadline earlier than the current one is pushed
+std::condition_variable detector_cv;
 
 
 //func declarations
-// modified to return zNode* instead of int
-zNode* findServer(std::vector<zNode*> v, int id); 
-std::time_t getTimeNow();
+zNode* findServer(int clusterID, int serverID);
+void publishRoutingTable();
+void updateCluster(int clusterID);
+void scheduleDeadline(zNode* z);
 void checkHeartbeat();
 
 
 bool zNode::isActive(){
-    bool status = false;
-    if(!missed_heartbeat){
-        status = true;
-    }else if(difftime(getTimeNow(),last_heartbeat) < 10){
-        status = true;
+    return !missed_heartbeat;
+}
+
+ServerInfo zNode::info() const {
+    ServerInfo info;
+    info.set_clusterid(clusterID);
+    info.set_serverid(serverID);
+    info.set_hostname(hostname);
+    info.set_port(port);
+    info.set_type(type);
+    return info;
+}
+
+// must be called with v_mutex held
+zNode* findServer(int clusterID, int serverID) {
+    auto it = registry.find(serverKey(clusterID, serverID));
+    return it == registry.end() ? nullptr : it->second;
+}
+
+// pushes the node's next failure deadline. must be called with v_mutex held
+void scheduleDeadline(zNode* z) {
+    Deadline d{z->detector.deadline(phi_threshold), serverKey(z->clusterID, z->serverID), z->heartbeats};
+    bool earliest = deadlines.empty() || d.when < deadlines.top().when;
+    deadlines.push(d);
+    if (earliest) detector_cv.notify_one();
+}
+
+// rebuilds the routing table from the registry and publishes it.
+// must be called with v_mutex held
+void publishRoutingTable() {
+    auto table = std::make_shared<RoutingTable>();
+    table->version = std::atomic_load(&routing_table)->version + 1;
+    for (auto& cluster : clusters) {
+        table->ring.addCluster(cluster.first);
+        for (zNode* z : cluster.second) {
+            z->routed = z->isActive();
+            if (!z->routed) continue;
+            ServerInfo server = z->info();
+            table->clusters[cluster.first].push_back(server);
+            if (z->type == "Master") table->routes[cluster.first].push_back(server);
+        }
+        if (!table->routes.count(cluster.first) && table->clusters.count(cluster.first)) {
+            table->routes[cluster.first] = table->clusters[cluster.first];
+        }
     }
-    return status;
+    {
+        std::lock_guard<std::mutex> lock(watch_mutex);
+        std::atomic_store(&routing_table, std::shared_ptr<const RoutingTable>(table));
+    }
+    watch_cv.notify_all();
 }
 
-zNode* findServer(std::vector<zNode*> v, int id) {
-    for (auto s : v) if (s->serverID == id) return s;
-    return nullptr;
-} 
+CoordSnapshot buildSnapshot() {
+    CoordSnapshot snapshot;
+    for (auto& entry : registry) *snapshot.add_servers() = entry.second->info();
+    for (auto& node : znodes.dump()) {
+        ZnodeRecord* record = snapshot.add_znodes();
+        record->set_path(node.path);
+        record->set_data(node.data);
+        record->set_owner(node.owner);
+        record->set_cversion(node.cversion);
+    }
+    return snapshot;
+}
+
+// appends a change to the state log, compacting it into a new snapshot once
+// it grows long. must be called with v_mutex held
+void persist(const LogRecord& record) {
+    if (raft) {
+        // false only if leadership was just lost, and the state gets reset
+        raft->propose(record);
+        return;
+    }
+    if (!state_log.append(record)) {
+        log(WARNING, "Could not append to the state log in " << data_dir);
+    }
+    if (state_log.records() >= snapshot_every && !state_log.writeSnapshot(buildSnapshot())) {
+        log(WARNING, "Could not write a snapshot to " << data_dir);
+    }
+}
+
+zNode* restoreServer(const ServerInfo& info) {
+    zNode* z = findServer(info.clusterid(), info.serverid());
+    if (!z) {
+        z = new zNode(info.clusterid(), info.serverid());
+        registry[serverKey(z->clusterID, z->serverID)] = z;
+        clusters[z->clusterID].push_back(z);
+        z->type = "Slave";
+    }
+    z->hostname = info.hostname();
+    z->port = info.port();
+    return z;
+}
+
+void restoreMaster(int clusterID, int serverID) {
+    for (zNode* z : clusters[clusterID]) z->type = (z->serverID == serverID) ? "Master" : "Slave";
+    if (serverID) masters[clusterID] = serverKey(clusterID, serverID);
+    else masters.erase(clusterID);
+}
+
+// applies a logged change, when restoring the state log or following the
+// Raft leader. must be called with v_mutex held
+void applyRecord(const LogRecord& record) {
+    auto it = registry.end();
+    switch (record.op_case()) {
+        case LogRecord::kServer:
+            restoreServer(record.server());
+            break;
+        case LogRecord::kMaster:
+            restoreMaster(record.master().clusterid(), record.master().serverid());
+            break;
+        case LogRecord::kCreate:
+            // replayed in order, so sequential names come out the same
+            znodes.create(record.create().path(), record.create().data(), record.create().owner());
+            break;
+        case LogRecord::kCloseSession:
+            znodes.closeSession(record.close_session());
+            break;
+        case LogRecord::kFailed:
+        case LogRecord::kRecovered:
+            it = registry.find(record.op_case() == LogRecord::kFailed ? record.failed() : record.recovered());
+            if (it != registry.end()) it->second->missed_heartbeat = record.op_case() == LogRecord::kFailed;
+            break;
+        default:
+            break;
+    }
+}
+
+// re-elects the cluster's master if it has none or it failed, republishes the
+// routing table and tells the cluster's servers about the change over their
+// heartbeat streams. must be called with v_mutex held
+void updateCluster(int clusterID) {
+    std::vector<zNode*>& members = clusters[clusterID];
+    zNode* oldMaster = nullptr;
+    auto current = masters.find(clusterID);
+    if (current != masters.end()) oldMaster = registry[current->second];
+
+    zNode* master = (oldMaster && oldMaster->isActive()) ? oldMaster : nullptr;
+    if (!master) {
+        // lowest active server ID wins, so every coordinator picks the same one
+        for (zNode* z : members) {
+            if (z->isActive() && (!master || z->serverID < master->serverID)) master = z;
+        }
+    }
+    if (master) masters[clusterID] = serverKey(clusterID, master->serverID);
+    else masters.erase(clusterID);
+    for (zNode* z : members) z->type = (z == master) ? "Master" : "Slave";
+    if (master != oldMaster) {
+        log(INFO, "Cluster " << clusterID << " master is now "
+            << (master ? "server " + std::to_string(master->serverID) : std::string("none")));
+        LogRecord record;
+        record.mutable_master()->set_clusterid(clusterID);
+        record.mutable_master()->set_serverid(master ? master->serverID : 0);
+        persist(record);
+    }
+
+    publishRoutingTable();
+
+    CoordCommand cmd;
+    if (master) *cmd.mutable_master() = master->info();
+    for (zNode* z : members) {
+        if (z->isActive()) *cmd.add_members() = z->info();
+    }
+    for (zNode* z : members) {
+        if (!z->commands) continue;
+        if (z == master && master != oldMaster) cmd.set_type(CoordCommand::PROMOTE);
+        else if (z == oldMaster && master != oldMaster) cmd.set_type(CoordCommand::DEMOTE);
+        else cmd.set_type(CoordCommand::MEMBERSHIP);
+        z->commands->push(cmd);
+    }
+}
 
 
 class CoordServiceImpl final : public CoordService::Service {
 
+    // in a replicated group only the leader takes heartbeats and writes; the
+    // others send callers to it. checked with v_mutex held, so a change made
+    // after the check is always undone by the reset that follows a step-down
+    static bool redirect(ServerContext* context, Status* status) {
+        if (!raft || raft->isLeader()) return false;
+        std::string leader = raft->leaderAddress();
+        if (!leader.empty()) context->AddTrailingMetadata("coordinator-leader", leader);
+        *status = Status(grpc::StatusCode::UNAVAILABLE,
+                         leader.empty() ? "no coordinator leader" : "not the leader, use " + leader);
+        return true;
+    }
+
+    // bounded staleness for reads served by any member of a replicated group
+    static bool stale(Status* status) {
+        if (!raft || raft->staleness() <= std::chrono::milliseconds(max_staleness_ms)) return false;
+        *status = Status(grpc::StatusCode::UNAVAILABLE, "coordinator state may be stale");
+        return true;
+    }
+
     Status Heartbeat(ServerContext* context, const ServerInfo* serverinfo, Confirmation* confirmation) override {
-        v_mutex.lock();
-        zNode* z = findServer(clusters[serverinfo->clusterid()-1], serverinfo->serverid());
+        std::lock_guard<std::mutex> lock(v_mutex);
+        Status status;
+        if (redirect(context, &status)) return status;
+        recordHeartbeat(*serverinfo);
+        return Status::OK;
+    }
+
+    Status HeartbeatStream(ServerContext* context, ServerReaderWriter<CoordCommand, ServerInfo>* stream) override {
+        ServerInfo serverinfo;
+        if (!stream->Read(&serverinfo)) return Status::OK;
+        auto channel = std::make_shared<CommandChannel>();
+        {
+            std::lock_guard<std::mutex> lock(v_mutex);
+            Status status;
+            if (redirect(context, &status)) return status;
+            zNode* z = recordHeartbeat(serverinfo);
+            z->commands = channel;
+            // start the server off with its role and the cluster's membership
+            CoordCommand cmd;
+            cmd.set_type(z->type == "Master" ? CoordCommand::PROMOTE : CoordCommand::MEMBERSHIP);
+            auto master = masters.find(z->clusterID);
+            if (master != masters.end()) *cmd.mutable_master() = registry[master->second]->info();
+            for (zNode* m : clusters[z->clusterID]) {
+                if (m->isActive()) *cmd.add_members() = m->info();
+            }
+            channel->push(cmd);
+        }
+        log(INFO, "Heartbeat stream opened by server " << serverinfo.serverid() << " in cluster " << serverinfo.clusterid());
+
+        // heartbeats are read on a second thread while this one writes commands.
+        // a stream this coordinator can no longer serve ends with an error, so
+        // the server moves to the leader right away
+        Status result;
+        std::thread reader([&]() {
+            ServerInfo info;
+            while (stream->Read(&info)) {
+                std::lock_guard<std::mutex> lock(v_mutex);
+                if (redirect(context, &result)) break;
+                if (channel->isClosed()) {
+                    // closed by resetReplicated
+                    std::string leader = raft ? raft->leaderAddress() : "";
+                    if (!leader.empty()) context->AddTrailingMetadata("coordinator-leader", leader);
+                    result = Status(grpc::StatusCode::UNAVAILABLE, "coordinator state was reset");
+                    break;
+                }
+                recordHeartbeat(info);
+            }
+            channel->close();
+        });
+        CoordCommand cmd;
+        while (channel->next(&cmd)) {
+            if (!stream->Write(cmd)) {
+                context->TryCancel();
+                break;
+            }
+        }
+        reader.join();
+
+        std::lock_guard<std::mutex> lock(v_mutex);
+        zNode* z = findServer(serverinfo.clusterid(), serverinfo.serverid());
+        if (z && z->commands == channel) z->commands.reset();
+        log(INFO, "Heartbeat stream closed by server " << serverinfo.serverid() << " in cluster " << serverinfo.clusterid());
+        return result;
+    }
+
+    // records a heartbeat, registering the server if it is new.
+    // must be called with v_mutex held
+    static zNode* recordHeartbeat(const ServerInfo& serverinfo) {
+        zNode* z = findServer(serverinfo.clusterid(), serverinfo.serverid());
         if (z) {
-            z->last_heartbeat = getTimeNow();
+            // no per-heartbeat log: flushing it dominated heartbeat cost
+            z->detector.heartbeat(PhiAccrualDetector::Clock::now());
+            z->heartbeats++;
             z->missed_heartbeat = false;
-            log(INFO, "Updated heartbeat for cluster " + std::to_string(serverinfo->clusterid()) + " and server ID " + std::to_string(serverinfo->serverid()));
+            scheduleDeadline(z);
+            if (!z->routed) {
+                log(INFO, "Server " + std::to_string(z->serverID) + " in cluster " + std::to_string(z->clusterID) + " is back");
+                LogRecord record;
+                record.set_recovered(serverKey(z->clusterID, z->serverID));
+                persist(record);
+                updateCluster(z->clusterID);
+            }
         } else {
-            zNode* node = new zNode();
-            node->serverID = serverinfo->serverid();
-            node->hostname = serverinfo->hostname();
-            node->port = serverinfo->port();
-            node->type = "Active";
-            node->last_heartbeat = getTimeNow();
-            node->missed_heartbeat = false;
-            clusters[serverinfo->clusterid()-1].push_back(node);
-            log(INFO, "Added zNode to cluster " + std::to_string(serverinfo->clusterid()) + " and server ID " + std::to_string(serverinfo->serverid()));
-        }
-        v_mutex.unlock();
+            z = new zNode(serverinfo.clusterid(), serverinfo.serverid());
+            z->hostname = serverinfo.hostname();
+            z->port = serverinfo.port();
+            z->type = "Slave";
+            registry[serverKey(z->clusterID, z->serverID)] = z;
+            clusters[z->clusterID].push_back(z);
+            scheduleDeadline(z);
+            LogRecord record;
+            *record.mutable_server() = z->info();
+            persist(record);
+            log(INFO, "Added zNode to cluster " + std::to_string(serverinfo.clusterid()) + " and server ID " + std::to_string(serverinfo.serverid()));
+            updateCluster(z->clusterID);
+        }
+        return z;
+    }
+
+    Status Watch(ServerContext* context, const WatchRequest* request, ServerWriter<RoutingUpdate>* writer) override {
+        Status status;
+        if (stale(&status)) return status;
+        log(INFO, "Watch opened for cluster " << request->clusterid());
+        // version last written; the current table always goes out first
+        uint64_t sent = UINT64_MAX;
+        while (!context->IsCancelled()) {
+            std::shared_ptr<const RoutingTable> table;
+            {
+                std::unique_lock<std::mutex> lock(watch_mutex);
+                // wake up now and then to notice cancelled watchers
+                watch_cv.wait_for(lock, std::chrono::seconds(1), [&]() {
+                    return std::atomic_load(&routing_table)->version != sent;
+                });
+                table = std::atomic_load(&routing_table);
+            }
+            // a member cut off from the leader ends the stream, so the
+            // watcher reconnects to one that is current
+            if (stale(&status)) {
+                log(INFO, "Watch closed for cluster " << request->clusterid() << ", state may be stale");
+                return status;
+            }
+            if (table->version == sent) continue;
+
+            RoutingUpdate update;
+            update.set_version(table->version);
+            for (auto& cluster : table->clusters) {
+                if (request->clusterid() != 0 && request->clusterid() != cluster.first) continue;
+                ClusterRoute* route = update.add_clusters();
+                route->set_clusterid(cluster.first);
+                for (auto& server : cluster.second) {
+                    if (server.type() == "Master") *route->mutable_master() = server;
+                    *route->add_members() = server;
+                }
+            }
+            if (!writer->Write(update)) break;
+            sent = table->version;
+        }
+        log(INFO, "Watch closed for cluster " << request->clusterid());
         return Status::OK;
     }
 
-    //function returns the server information for requested client id
-    //this function assumes there are always 3 clusters and has math
-    //hardcoded to represent this.
+    //function returns the server information for requested client id.
+    //places the client on its home cluster with the consistent hash ring.
+    //reads only the published routing table, so it never waits on heartbeats.
+    //no per-call log for the same reason
     Status GetServer(ServerContext* context, const ID* id, ServerInfo* serverinfo) override {
-        int cluster_id = (id->id()-1) % 3;
-        zNode* node = clusters[cluster_id][0];
-        serverinfo->set_clusterid(cluster_id);
-        serverinfo->set_serverid(node->serverID);
-        serverinfo->set_hostname(node->hostname);
-        serverinfo->set_port(node->port);
-        serverinfo->set_type(node->type);
+        Status status;
+        if (stale(&status)) return status;
+        std::shared_ptr<const RoutingTable> table = std::atomic_load(&routing_table);
+        int cluster_id = table->ring.clusterFor(id->id());
+        if (cluster_id < 0) {
+            return Status(grpc::StatusCode::UNAVAILABLE, "no cluster has registered");
+        }
+        auto cluster = table->routes.find(cluster_id);
+        if (cluster == table->routes.end() || cluster->second.empty()) {
+            return Status(grpc::StatusCode::UNAVAILABLE, "no active server in cluster " + std::to_string(cluster_id));
+        }
+        *serverinfo = cluster->second[0];
+        return Status::OK;
+    }
 
-        log(INFO, "Client " << id->id() << " assigned to cluster " << cluster_id << "and server ID " << node->serverID);
+    Status create(ServerContext* context, const PathAndData* request, csce438::Status* result) override {
+        ZnodeStore::SessionId owner = 0;
+        // held across the create so the session can't close half way through
+        // and the log sees creates in the order they happened
+        std::lock_guard<std::mutex> lock(v_mutex);
+        Status status;
+        if (redirect(context, &status)) return status;
+        if (request->ephemeral()) {
+            zNode* z = findServer(request->clusterid(), request->serverid());
+            if (!z || !z->isActive()) {
+                return Status(grpc::StatusCode::FAILED_PRECONDITION, "ephemeral nodes need an active heartbeat session");
+            }
+            owner = serverKey(z->clusterID, z->serverID);
+        }
+        std::string created;
+        ZnodeStore::Result r = znodes.create(request->path(), request->data(), owner, request->sequential(), &created);
+        result->set_status(r == ZnodeStore::OK);
+        result->set_path(created);
+        if (r == ZnodeStore::OK) {
+            LogRecord record;
+            record.mutable_create()->set_path(created);
+            record.mutable_create()->set_data(request->data());
+            record.mutable_create()->set_owner(owner);
+            persist(record);
+        }
+        return Status::OK;
+    }
 
+    //lock-free: reads the published znode tree
+    Status exists(ServerContext* context, const Path* request, csce438::Status* result) override {
+        Status status;
+        if (stale(&status)) return status;
+        std::string data;
+        result->set_status(znodes.get(request->path(), &data));
+        result->set_data(data);
         return Status::OK;
     }
 
+    // the znode store's one-shot watch, held open as a stream until it fires
+    Status watch(ServerContext* context, const Path* request, ServerWriter<WatchEvent>* writer) override {
+        Status status;
+        if (stale(&status)) return status;
+        struct Fired {
+            std::mutex mu;
+            std::condition_variable cv;
+            bool done = false;
+            ZnodeStore::Event event = ZnodeStore::CREATED;
+        };
+        // the store keeps the watcher until the path changes, which may be
+        // after this call has gone
+        auto fired = std::make_shared<Fired>();
+        bool present = znodes.watch(request->path(), [fired](const std::string&, ZnodeStore::Event event) {
+            std::lock_guard<std::mutex> lock(fired->mu);
+            fired->done = true;
+            fired->event = event;
+            fired->cv.notify_all();
+        });
+        WatchEvent current;
+        current.set_type(WatchEvent::CURRENT);
+        current.set_path(request->path());
+        current.set_exists(present);
+        if (!writer->Write(current)) return Status::OK;
+
+        WatchEvent change;
+        change.set_path(request->path());
+        while (!context->IsCancelled()) {
+            {
+                std::unique_lock<std::mutex> lock(fired->mu);
+                // wake up now and then to notice cancelled watchers
+                if (fired->cv.wait_for(lock, std::chrono::seconds(1), [&]() { return fired->done; })) {
+                    change.set_type(fired->event == ZnodeStore::CREATED ? WatchEvent::CREATED : WatchEvent::DELETED);
+                    break;
+                }
+            }
+            if (stale(&status)) return status;
+            // a reset of the tree drops watches without firing them
+            if (znodes.exists(request->path()) != present) {
+                change.set_type(present ? WatchEvent::DELETED : WatchEvent::CREATED);
+                break;
+            }
+        }
+        if (context->IsCancelled()) return Status::OK;
+        change.set_exists(change.type() == WatchEvent::CREATED);
+        writer->Write(change);
+        return Status::OK;
+    }
 
 };
 
-void RunServer(std::string port_no){
+// rebuilds the registry and znode tree from the state log and publishes the
+// last known routing table before the server starts. restored servers count
+// as active until restart_grace_ms passes without a heartbeat
+void restoreState() {
+    auto start = std::chrono::steady_clock::now();
+    CoordSnapshot snapshot;
+    std::vector<LogRecord> records;
+    if (!state_log.open(data_dir, &snapshot, &records)) {
+        log(ERROR, "Could not open the state log in " << data_dir << ", starting empty");
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(v_mutex);
+    for (auto& info : snapshot.servers()) {
+        restoreServer(info);
+        if (info.type() == "Master") restoreMaster(info.clusterid(), info.serverid());
+    }
+    for (auto& node : snapshot.znodes()) {
+        znodes.restore(ZnodeStore::Entry{node.path(), node.data(), node.owner(), node.cversion()});
+    }
+    for (auto& record : records) applyRecord(record);
+
+    auto grace = PhiAccrualDetector::Clock::now() + std::chrono::milliseconds(restart_grace_ms);
+    for (auto& entry : registry) {
+        deadlines.push(Deadline{grace, entry.first, entry.second->heartbeats});
+    }
+    publishRoutingTable();
+    // start the next log from the state just restored
+    if (!state_log.writeSnapshot(buildSnapshot())) {
+        log(WARNING, "Could not write a snapshot to " << data_dir);
+    }
+    double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    log(INFO, "Restored " << registry.size() << " servers in " << clusters.size() << " clusters and "
+        << snapshot.znodes_size() << " snapshot znodes + " << records.size() << " log records in "
+        << elapsed_ms << " ms");
+}
+
+// Raft callbacks for replicated mode
+
+void applyReplicated(const std::vector<LogRecord>& records) {
+    std::lock_guard<std::mutex> lock(v_mutex);
+    for (auto& record : records) applyRecord(record);
+    publishRoutingTable();
+}
+
+void resetReplicated() {
+    std::lock_guard<std::mutex> lock(v_mutex);
+    for (auto& entry : registry) {
+        // ends the server's heartbeat stream, it reconnects to the new leader
+        if (entry.second->commands) entry.second->commands->close();
+        delete entry.second;
+    }
+    registry.clear();
+    clusters.clear();
+    masters.clear();
+    deadlines = decltype(deadlines)();
+    znodes.clear();
+    publishRoutingTable();
+    log(INFO, "Reset coordinator state to the committed log");
+}
+
+void leadershipChanged(bool leader) {
+    if (!leader) {
+        log(INFO, "No longer the coordinator leader");
+        return;
+    }
+    std::lock_guard<std::mutex> lock(v_mutex);
+    // servers get a grace period to move their heartbeats over, and their
+    // detectors start from now rather than from when they were replicated
+    auto grace = PhiAccrualDetector::Clock::now() + std::chrono::milliseconds(restart_grace_ms);
+    for (auto& entry : registry) {
+        entry.second->detector = PhiAccrualDetector(heartbeat_interval_ms, min_std_ms);
+        deadlines.push(Deadline{grace, entry.first, entry.second->heartbeats});
+    }
+    detector_cv.notify_one();
+    publishRoutingTable();
+    log(INFO, "Coordinator leader for " << registry.size() << " servers");
+}
+
+std::vector<std::string> splitList(const std::string& list) {
+    std::vector<std::string> items;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+void RunServer(std::string port_no, int raft_id, const std::string& raft_group){
+    std::unique_ptr<RaftServiceImpl> raft_service;
+    if (raft_group.empty()) {
+        restoreState();
+    } else {
+        std::vector<std::string> group = splitList(raft_group);
+        RaftNode::Callbacks callbacks{applyReplicated, resetReplicated, leadershipChanged};
+        raft.reset(new RaftNode(raft_id, group, data_dir, callbacks));
+        if (!raft->start()) {
+            log(ERROR, "Could not open the Raft log in " << data_dir);
+            return;
+        }
+        raft_service.reset(new RaftServiceImpl(*raft));
+        log(INFO, "Coordinator " << raft_id << " of " << group.size() << " in a replicated group");
+    }
     //start thread to check heartbeats
     std::thread hb(checkHeartbeat);
     std::string server_address("127.0.0.1:"+port_no);
@@ -142,6 +775,7 @@ void RunServer(std::string port_no){
     // Register "service" as the instance through which we'll communicate with
     // clients. In this case it corresponds to an *synchronous* service.
     builder.RegisterService(&service);
+    if (raft_service) builder.RegisterService(raft_service.get());
     // Finally assemble the server.
     std::unique_ptr<Server> server(builder.BuildAndStart());
     std::cout << "Server listening on " << server_address << std::endl;
@@ -154,12 +788,44 @@ void RunServer(std::string port_no){
 int main(int argc, char** argv) {
 
     std::string port = "3010";
+    int raft_id = 0;
+    std::string raft_group;
     int opt = 0;
-    while ((opt = getopt(argc, argv, "p:")) != -1){
+    while ((opt = getopt(argc, argv, "p:v:i:f:m:d:s:g:n:c:t:")) != -1){
         switch(opt) {
             case 'p':
                 port = optarg;
                 break;
+            case 'v':
+                ring_vnodes = atoi(optarg);
+                break;
+            case 'i':
+                heartbeat_interval_ms = atof(optarg);
+                break;
+            case 'f':
+                phi_threshold = atof(optarg);
+                break;
+            case 'm':
+                min_std_ms = atof(optarg);
+                break;
+            case 'd':
+                data_dir = optarg;
+                break;
+            case 's':
+                snapshot_every = atoi(optarg);
+                break;
+            case 'g':
+                restart_grace_ms = atoi(optarg);
+                break;
+            case 'n':
+                raft_id = atoi(optarg);
+                break;
+            case 'c':
+                raft_group = optarg;
+                break;
+            case 't':
+                max_staleness_ms = atoi(optarg);
+                break;
             default:
                 std::cerr << "Invalid Command Line Argument\n";
         }
@@ -167,39 +833,45 @@ int main(int argc, char** argv) {
     std::string log_file_name = std::string("coordinator-") + port;
     google::InitGoogleLogging(log_file_name.c_str());
     log(INFO, "Logging Initialized. Server starting...");
-    RunServer(port);
+    RunServer(port, raft_id, raft_group);
     return 0;
 }
 
 
 
+// waits for the earliest failure deadline and marks its server failed if no
+// heartbeat arrived since the deadline was set
 void checkHeartbeat(){
+    std::unique_lock<std::mutex> lock(v_mutex);
     while(true){
-        //check servers for heartbeat > 10
-        //if true turn missed heartbeat = true
-        v_mutex.lock();
-
-        // iterating through the clusters vector of vectors of znodes
-        for (auto& c : clusters){
-            for(auto& s : c){
-                if(difftime(getTimeNow(),s->last_heartbeat)>10){
-                    log(INFO, "Missed heartbeat from server " << s->serverID);
-                    if(!s->missed_heartbeat){
-                        s->missed_heartbeat = true;
-                        s->last_heartbeat = getTimeNow();
-                    }
-                }
-            }
+        if (deadlines.empty()) {
+            detector_cv.wait(lock);
+            continue;
         }
-
-        v_mutex.unlock();
-
-        sleep(3);
+        Deadline next = deadlines.top();
+        if (PhiAccrualDetector::Clock::now() < next.when) {
+            detector_cv.wait_until(lock, next.when);
+            continue;
+        }
+        deadlines.pop();
+
+        auto it = registry.find(next.key);
+        if (it == registry.end()) continue;
+        zNode* s = it->second;
+        if (s->heartbeats != next.heartbeats || s->missed_heartbeat) continue;
+
+        s->missed_heartbeat = true;
+        double silent_ms = std::chrono::duration<double, std::milli>(
+            PhiAccrualDetector::Clock::now() - s->detector.lastHeartbeat()).count();
+        log(INFO, "Missed heartbeat from server " << s->serverID << " in cluster " << s->clusterID
+            << " (silent " << static_cast<long>(silent_ms) << " ms)");
+        LogRecord failed;
+        failed.set_failed(next.key);
+        persist(failed);
+        updateCluster(s->clusterID);
+        znodes.closeSession(next.key);
+        LogRecord record;
+        record.set_close_session(next.key);
+        persist(record);
     }
 }
-
-
-std::time_t getTimeNow(){
-    return std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-}
-
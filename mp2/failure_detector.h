@@ -0,0 +1,85 @@
+#ifndef FAILURE_DETECTOR_H
+#define FAILURE_DETECTOR_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <deque>
+
+// Phi accrual failure detector for a single server (Hayashibara et al.).
+//
+// Heartbeat inter-arrival times are modelled as a normal distribution over a
+// sliding window. phi is -log10 of the probability that the next heartbeat
+// is still on its way after the time elapsed since the last one, so the
+// suspicion threshold adapts to how regular a server's heartbeats really are.
+class PhiAccrualDetector {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // the window starts out as if one heartbeat had arrived after expectedIntervalMs
+    PhiAccrualDetector(double expectedIntervalMs, double minStdMs)
+        : minStdMs(minStdMs), last(Clock::now()) {
+        add(expectedIntervalMs);
+    }
+
+    void heartbeat(Clock::time_point now) {
+        add(std::chrono::duration<double, std::milli>(now - last).count());
+        last = now;
+    }
+
+    Clock::time_point lastHeartbeat() const { return last; }
+
+    double phi(Clock::time_point now) const {
+        double elapsed = std::chrono::duration<double, std::milli>(now - last).count();
+        double tail = 0.5 * std::erfc((elapsed - mean()) / (stddev() * std::sqrt(2.0)));
+        return -std::log10(std::max(tail, 1e-300));
+    }
+
+    // when phi will reach the threshold if no further heartbeat arrives
+    Clock::time_point deadline(double threshold) const {
+        double ms = mean() + zForPhi(threshold) * stddev();
+        return last + std::chrono::microseconds(static_cast<long long>(ms * 1000));
+    }
+
+private:
+    static const size_t WINDOW = 100;
+
+    void add(double intervalMs) {
+        intervals.push_back(intervalMs);
+        sum += intervalMs;
+        sumSq += intervalMs * intervalMs;
+        if (intervals.size() > WINDOW) {
+            sum -= intervals.front();
+            sumSq -= intervals.front() * intervals.front();
+            intervals.pop_front();
+        }
+    }
+
+    double mean() const { return sum / intervals.size(); }
+
+    double stddev() const {
+        double m = mean();
+        double var = sumSq / intervals.size() - m * m;
+        return std::max(minStdMs, std::sqrt(std::max(var, 0.0)));
+    }
+
+    // z such that the normal upper tail beyond z is 10^-phi
+    static double zForPhi(double phi) {
+        double target = std::pow(10.0, -phi);
+        double lo = 0, hi = 40;
+        for (int i = 0; i < 60; i++) {
+            double mid = (lo + hi) / 2;
+            if (0.5 * std::erfc(mid / std::sqrt(2.0)) > target) lo = mid;
+            else hi = mid;
+        }
+        return hi;
+    }
+
+    double minStdMs;
+    std::deque<double> intervals;
+    double sum = 0;
+    double sumSq = 0;
+    Clock::time_point last;
+};
+
+#endif
@@ -0,0 +1,108 @@
+// Loads a social graph into a server from an edge list, using BulkFollow.
+//
+//   ./graph_import -s 127.0.0.1:3011 -f edges.txt -b 10000 -c
+//
+// The file has one "follower followee" pair per line, separated by spaces
+// or tabs; lines starting with # are skipped, as in SNAP edge lists.
+// -s server (the cluster's master), -f edge list, -b edges per call,
+// -c create users the server doesn't know yet.
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <stdlib.h>
+#include <unistd.h>
+#include <grpc++/grpc++.h>
+
+#include "sns_v2.grpc.pb.h"
+
+using grpc::ClientContext;
+using grpc::Status;
+namespace v2 = csce438::v2;
+
+int main(int argc, char** argv) {
+    std::string server = "127.0.0.1:3011";
+    std::string path;
+    int batch_size = 10000;
+    bool create_users = false;
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "s:f:b:c")) != -1){
+        switch(opt) {
+            case 's':
+                server = optarg;
+                break;
+            case 'f':
+                path = optarg;
+                break;
+            case 'b':
+                batch_size = std::max(1, atoi(optarg));
+                break;
+            case 'c':
+                create_users = true;
+                break;
+            default:
+                std::cerr << "Invalid Command Line Argument\n";
+        }
+    }
+    std::ifstream edges(path);
+    if (!edges) {
+        std::cerr << "Cannot read edge list " << path << std::endl;
+        return 1;
+    }
+
+    std::unique_ptr<v2::SNSService::Stub> stub = v2::SNSService::NewStub(
+        grpc::CreateChannel(server, grpc::InsecureChannelCredentials()));
+
+    long sent = 0, applied = 0, duplicates = 0, invalid = 0, calls = 0;
+    auto start = std::chrono::steady_clock::now();
+    v2::BulkFollowRequest request;
+    request.set_create_users(create_users);
+    std::string line;
+    bool more = true;
+    while (more) {
+        more = static_cast<bool>(std::getline(edges, line));
+        if (more) {
+            if (line.empty() || line[0] == '#') continue;
+            std::istringstream fields(line);
+            std::string follower, followee;
+            if (!(fields >> follower >> followee)) {
+                invalid++;
+                continue;
+            }
+            v2::Edge* e = request.add_edges();
+            e->set_follower(follower);
+            e->set_followee(followee);
+            if (request.edges_size() < batch_size) continue;
+        }
+        if (request.edges_size() == 0) break;
+
+        v2::BulkFollowReply reply;
+        ClientContext context;
+        Status status = stub->BulkFollow(&context, request, &reply);
+        if (!status.ok()) {
+            std::cerr << "BulkFollow failed after " << sent << " edges: " << status.error_message() << std::endl;
+            return 1;
+        }
+        sent += request.edges_size();
+        applied += reply.applied();
+        duplicates += reply.duplicates();
+        invalid += reply.invalid();
+        calls++;
+        request.clear_edges();
+        if (calls % 100 == 0) {
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cout << sent << " edges, " << static_cast<long>(sent / elapsed) << " edges/s" << std::endl;
+        }
+    }
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << sent << " edges in " << calls << " calls, " << elapsed << " s ("
+              << (elapsed > 0 ? static_cast<long>(sent / elapsed) : 0) << " edges/s): "
+              << applied << " applied, " << duplicates << " duplicates, " << invalid << " invalid" << std::endl;
+    return 0;
+}
@@ -0,0 +1,66 @@
+#ifndef HASH_RING_H
+#define HASH_RING_H
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <vector>
+
+// Consistent hash ring used to place users on clusters.
+//
+// Each cluster owns `vnodes` points on a 64-bit ring and a user belongs to
+// the cluster owning the first point at or after the hash of the user's id.
+// Adding or removing a cluster therefore only moves the users that land on
+// that cluster's points, roughly 1/N of them, instead of remapping everyone
+// the way `id % N` does.
+class HashRing {
+public:
+    explicit HashRing(int vnodes = 100) : vnodes(vnodes) {}
+
+    void addCluster(int clusterID) {
+        if (!members.insert(clusterID).second) return;
+        for (int v = 0; v < vnodes; v++) {
+            ring.emplace(pointHash(clusterID, v), clusterID);
+        }
+    }
+
+    void removeCluster(int clusterID) {
+        if (!members.erase(clusterID)) return;
+        for (int v = 0; v < vnodes; v++) {
+            auto it = ring.find(pointHash(clusterID, v));
+            // on a (very unlikely) collision the point belongs to whoever got it first
+            if (it != ring.end() && it->second == clusterID) ring.erase(it);
+        }
+    }
+
+    bool empty() const { return ring.empty(); }
+
+    const std::set<int>& clusters() const { return members; }
+
+    // cluster that owns the user, or -1 if no cluster has joined
+    int clusterFor(int userID) const {
+        if (ring.empty()) return -1;
+        auto it = ring.lower_bound(mix(static_cast<uint64_t>(static_cast<uint32_t>(userID))));
+        if (it == ring.end()) it = ring.begin();
+        return it->second;
+    }
+
+private:
+    // splitmix64 finalizer: cheap, stable across builds and well distributed
+    static uint64_t mix(uint64_t x) {
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    static uint64_t pointHash(int clusterID, int vnode) {
+        return mix((static_cast<uint64_t>(static_cast<uint32_t>(clusterID)) << 32) ^ mix(static_cast<uint64_t>(vnode)));
+    }
+
+    int vnodes;
+    std::set<int> members;
+    std::map<uint64_t, int> ring;
+};
+
+#endif
@@ -0,0 +1,116 @@
+// Heartbeat load generator for the coordinator.
+//
+// Simulates many servers spread over a number of clusters, each sending
+// Heartbeat RPCs back to back, and reports heartbeat throughput and latency.
+//
+//   ./hb_bench -h 127.0.0.1 -k 3010 -n 5000 -c 50 -t 16 -d 10
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+#include <grpc++/grpc++.h>
+
+#include "coordinator.grpc.pb.h"
+
+using grpc::ClientContext;
+using grpc::Status;
+using csce438::CoordService;
+using csce438::ServerInfo;
+using csce438::Confirmation;
+
+int main(int argc, char** argv) {
+    std::string coordinator_ip = "127.0.0.1";
+    std::string coordinator_port = "3010";
+    int num_servers = 1000;
+    int num_clusters = 3;
+    int num_threads = 8;
+    int duration_secs = 10;
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "h:k:n:c:t:d:")) != -1){
+        switch(opt) {
+            case 'h':
+                coordinator_ip = optarg;
+                break;
+            case 'k':
+                coordinator_port = optarg;
+                break;
+            case 'n':
+                num_servers = atoi(optarg);
+                break;
+            case 'c':
+                num_clusters = atoi(optarg);
+                break;
+            case 't':
+                num_threads = atoi(optarg);
+                break;
+            case 'd':
+                duration_secs = atoi(optarg);
+                break;
+            default:
+                std::cerr << "Invalid Command Line Argument\n";
+        }
+    }
+
+    auto channel = grpc::CreateChannel(coordinator_ip + ":" + coordinator_port, grpc::InsecureChannelCredentials());
+    std::unique_ptr<CoordService::Stub> stub = CoordService::NewStub(channel);
+
+    std::atomic<bool> done{false};
+    std::atomic<long> failures{0};
+    std::vector<std::vector<long>> latencies(num_threads);
+    std::vector<std::thread> workers;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < num_threads; t++) {
+        workers.emplace_back([&, t]() {
+            // thread t owns simulated servers t, t + num_threads, ...
+            while (!done) {
+                for (int s = t; s < num_servers && !done; s += num_threads) {
+                    ServerInfo info;
+                    info.set_clusterid(s % num_clusters + 1);
+                    info.set_serverid(s / num_clusters + 1);
+                    info.set_hostname("127.0.0.1");
+                    info.set_port(std::to_string(20000 + s));
+                    info.set_type("Active");
+
+                    ClientContext context;
+                    Confirmation confirmation;
+                    auto sent = std::chrono::steady_clock::now();
+                    Status status = stub->Heartbeat(&context, info, &confirmation);
+                    latencies[t].push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - sent).count());
+                    if (!status.ok()) failures++;
+                }
+            }
+        });
+    }
+
+    sleep(duration_secs);
+    done = true;
+    for (auto& w : workers) w.join();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<long> all;
+    for (auto& l : latencies) all.insert(all.end(), l.begin(), l.end());
+    std::sort(all.begin(), all.end());
+    if (all.empty()) {
+        std::cout << "No heartbeats sent" << std::endl;
+        return 1;
+    }
+
+    std::cout << num_servers << " servers in " << num_clusters << " clusters, "
+              << num_threads << " threads, " << elapsed << " s" << std::endl;
+    std::cout << "heartbeats: " << all.size() << " (" << failures << " failed), "
+              << static_cast<long>(all.size() / elapsed) << " heartbeats/s" << std::endl;
+    std::cout << "latency us: p50 " << all[all.size() / 2]
+              << " p99 " << all[all.size() * 99 / 100]
+              << " max " << all.back() << std::endl;
+    return 0;
+}
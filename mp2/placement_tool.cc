@@ -0,0 +1,102 @@
+// Reports how the coordinator's consistent hash ring places users on
+// clusters, and how many users move when the set of clusters changes.
+//
+//   ./placement_tool -u 100000 -b 1,2,3 -a 1,2,3,4 -v 100
+//
+// -u number of users (ids 1..u), -b clusters before the change,
+// -a clusters after the change, -v virtual nodes per cluster.
+
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "hash_ring.h"
+
+std::vector<int> parseClusters(const std::string& list) {
+    std::vector<int> ids;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) ids.push_back(atoi(item.c_str()));
+    }
+    return ids;
+}
+
+void reportBalance(const std::string& label, const std::map<int, int>& counts, int users) {
+    double mean = static_cast<double>(users) / counts.size();
+    double var = 0;
+    int max = 0;
+    std::cout << label << ":" << std::endl;
+    for (auto& c : counts) {
+        std::cout << "  cluster " << c.first << ": " << c.second << " users" << std::endl;
+        var += (c.second - mean) * (c.second - mean);
+        if (c.second > max) max = c.second;
+    }
+    std::cout << std::fixed << std::setprecision(3)
+              << "  max/mean " << max / mean
+              << ", stddev/mean " << std::sqrt(var / counts.size()) / mean << std::endl;
+}
+
+int main(int argc, char** argv) {
+    int users = 100000;
+    int vnodes = 100;
+    std::vector<int> before = {1, 2, 3};
+    std::vector<int> after = {1, 2, 3, 4};
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "u:b:a:v:")) != -1){
+        switch(opt) {
+            case 'u':
+                users = atoi(optarg);
+                break;
+            case 'b':
+                before = parseClusters(optarg);
+                break;
+            case 'a':
+                after = parseClusters(optarg);
+                break;
+            case 'v':
+                vnodes = atoi(optarg);
+                break;
+            default:
+                std::cerr << "Invalid Command Line Argument\n";
+        }
+    }
+    if (users <= 0 || before.empty() || after.empty()) {
+        std::cerr << "Need at least one user and one cluster before and after\n";
+        return 1;
+    }
+
+    HashRing ringBefore(vnodes), ringAfter(vnodes);
+    for (int c : before) ringBefore.addCluster(c);
+    for (int c : after) ringAfter.addCluster(c);
+
+    std::map<int, int> countBefore, countAfter;
+    for (int c : before) countBefore[c] = 0;
+    for (int c : after) countAfter[c] = 0;
+    int moved = 0, movedModulo = 0;
+    for (int id = 1; id <= users; id++) {
+        int from = ringBefore.clusterFor(id);
+        int to = ringAfter.clusterFor(id);
+        countBefore[from]++;
+        countAfter[to]++;
+        if (from != to) moved++;
+        // what the old (id-1) % N placement would have done
+        if (before[(id - 1) % before.size()] != after[(id - 1) % after.size()]) movedModulo++;
+    }
+
+    std::cout << users << " users, " << vnodes << " virtual nodes per cluster" << std::endl;
+    reportBalance("before", countBefore, users);
+    reportBalance("after", countAfter, users);
+    std::cout << std::fixed << std::setprecision(2)
+              << "moved: " << moved << " users (" << 100.0 * moved / users << "%)"
+              << ", modulo placement would move " << movedModulo
+              << " (" << 100.0 * movedModulo / users << "%)" << std::endl;
+    return 0;
+}
@@ -0,0 +1,585 @@
+#ifndef RAFT_H
+#define RAFT_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <grpc++/grpc++.h>
+
+#include "coordinator.grpc.pb.h"
+
+// Raft (Ongaro & Ousterhout) over the coordinator's LogRecords, so a group
+// of 3-5 coordinators shares one registry and znode tree.
+//
+// The leader applies a change to its own state as it makes it and then
+// appends it to the replicated log; followers apply entries once a majority
+// stores them. A new leader first applies the rest of its log. A leader that
+// steps down has applied entries that may never commit, so it resets its
+// state and re-applies the committed prefix.
+//
+// Term, vote and log are kept under the data directory and the log is
+// fsync'd before an entry is acknowledged. The log is never compacted: it
+// only holds registrations, role changes and znode writes.
+class RaftNode {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Callbacks {
+        // applies records in log order, from one thread, with no Raft lock held
+        std::function<void(const std::vector<csce438::LogRecord>&)> apply;
+        // drops all applied state before the committed log is applied again
+        std::function<void()> reset;
+        // leadership gained (once the whole log is applied) or lost
+        std::function<void(bool leader)> leadership;
+    };
+
+    // `addresses` lists the whole group, this node's id is its position + 1
+    RaftNode(int id, const std::vector<std::string>& addresses, const std::string& dir, Callbacks callbacks,
+             int electionTimeoutMs = 300, int heartbeatMs = 50)
+        : id(id), addresses(addresses), dir(dir), callbacks(callbacks),
+          electionTimeoutMs(electionTimeoutMs), heartbeatMs(heartbeatMs),
+          rng(std::random_device{}()) {
+        for (size_t i = 0; i < addresses.size(); i++) {
+            if (static_cast<int>(i) + 1 == id) continue;
+            peers.emplace_back(new Peer{static_cast<int>(i) + 1, csce438::RaftService::NewStub(
+                grpc::CreateChannel(addresses[i], grpc::InsecureChannelCredentials()))});
+        }
+    }
+
+    ~RaftNode() {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            stopped = true;
+        }
+        applyCv.notify_all();
+        replicateCv.notify_all();
+        for (auto& t : threads) t.join();
+        if (fd >= 0) close(fd);
+    }
+
+    // loads the persisted term, vote and log and starts the election timer,
+    // the replicators and the applier
+    bool start() {
+        if (!load()) return false;
+        lastContact = Clock::now();
+        resetElectionTimeout();
+        threads.emplace_back(&RaftNode::tick, this);
+        threads.emplace_back(&RaftNode::applyLoop, this);
+        for (size_t p = 0; p < peers.size(); p++) threads.emplace_back(&RaftNode::replicate, this, p);
+        return true;
+    }
+
+    // leader with its whole log applied, so it may take writes
+    bool isLeader() const {
+        std::lock_guard<std::mutex> lock(mu);
+        return leaderReady;
+    }
+
+    // the current leader's address for redirects, empty if unknown
+    std::string leaderAddress() const {
+        std::lock_guard<std::mutex> lock(mu);
+        return leaderId > 0 ? addresses[leaderId - 1] : std::string();
+    }
+
+    // how old this node's view may be: for a follower, the time since the
+    // leader last reached it; for the leader, since a majority last answered.
+    // lock-free, for the read path
+    Clock::duration staleness() const {
+        if (peers.empty()) return Clock::duration::zero();
+        return Clock::now() - Clock::time_point(Clock::duration(freshAt.load()));
+    }
+
+    // appends a change the leader has already applied; false if this node
+    // can no longer take writes
+    bool propose(const csce438::LogRecord& record) {
+        std::lock_guard<std::mutex> lock(mu);
+        if (!leaderReady) return false;
+        csce438::RaftEntry entry;
+        entry.set_term(currentTerm);
+        *entry.mutable_record() = record;
+        append(entry);
+        lastApplied = lastIndex();
+        advanceCommit();
+        replicateCv.notify_all();
+        return true;
+    }
+
+    grpc::Status requestVote(const csce438::VoteRequest& request, csce438::VoteReply* reply) {
+        std::lock_guard<std::mutex> lock(mu);
+        bool upToDate = request.last_log_term() > lastTerm() ||
+            (request.last_log_term() == lastTerm() && request.last_log_index() >= lastIndex());
+        if (request.pre_vote()) {
+            // no state changes: a node coming back from a partition can't
+            // depose a leader the rest of the group still hears from
+            bool leaderAlive = leaderId > 0 && staleness() < std::chrono::milliseconds(electionTimeoutMs);
+            reply->set_term(currentTerm);
+            reply->set_granted(request.term() > currentTerm && upToDate && !leaderAlive);
+            return grpc::Status::OK;
+        }
+        if (request.term() > currentTerm) stepDown(request.term());
+        bool granted = request.term() == currentTerm && upToDate &&
+            (votedFor < 0 || votedFor == request.candidate());
+        if (granted) {
+            votedFor = request.candidate();
+            saveMeta();
+            lastContact = Clock::now();
+        }
+        reply->set_term(currentTerm);
+        reply->set_granted(granted);
+        return grpc::Status::OK;
+    }
+
+    grpc::Status appendEntries(const csce438::AppendRequest& request, csce438::AppendReply* reply) {
+        std::lock_guard<std::mutex> lock(mu);
+        reply->set_success(false);
+        if (request.term() < currentTerm) {
+            reply->set_term(currentTerm);
+            return grpc::Status::OK;
+        }
+        if (request.term() > currentTerm || role != FOLLOWER) stepDown(request.term());
+        reply->set_term(currentTerm);
+        leaderId = request.leader();
+        lastContact = Clock::now();
+        freshAt = lastContact.time_since_epoch().count();
+
+        uint64_t prev = request.prev_log_index();
+        if (prev > lastIndex()) {
+            reply->set_match_index(lastIndex());
+            return grpc::Status::OK;
+        }
+        if (log[prev].term() != request.prev_log_term()) {
+            // skip back over the whole conflicting term
+            uint64_t i = prev;
+            while (i > 1 && log[i - 1].term() == log[prev].term()) i--;
+            reply->set_match_index(i - 1);
+            return grpc::Status::OK;
+        }
+
+        uint64_t index = prev;
+        for (auto& entry : request.entries()) {
+            index++;
+            if (index <= lastIndex()) {
+                if (log[index].term() == entry.term()) continue;
+                truncate(index);
+            }
+            log.push_back(entry);
+            writeEntry(index);
+        }
+        if (fd >= 0 && !request.entries().empty()) fdatasync(fd);
+
+        if (request.leader_commit() > commitIndex) {
+            commitIndex = std::min<uint64_t>(request.leader_commit(), index);
+            applyCv.notify_all();
+        }
+        reply->set_success(true);
+        reply->set_match_index(index);
+        return grpc::Status::OK;
+    }
+
+private:
+    enum Role { FOLLOWER, CANDIDATE, LEADER };
+
+    struct Peer {
+        int id;
+        std::unique_ptr<csce438::RaftService::Stub> stub;
+        uint64_t next = 1;
+        uint64_t match = 0;
+        Clock::time_point nextHeartbeat;
+        // when the last answered AppendEntries was sent
+        Clock::time_point lastAck;
+    };
+
+    static const size_t MAX_ENTRIES_PER_APPEND = 1000;
+
+    uint64_t lastIndex() const { return log.size() - 1; }
+    uint64_t lastTerm() const { return log.back().term(); }
+
+    void resetElectionTimeout() {
+        std::uniform_int_distribution<int> jitter(electionTimeoutMs, 2 * electionTimeoutMs);
+        electionTimeout = std::chrono::milliseconds(jitter(rng));
+    }
+
+    // must be called with mu held
+    void stepDown(uint64_t term) {
+        if (term > currentTerm) {
+            currentTerm = term;
+            votedFor = -1;
+            saveMeta();
+        }
+        if (role == LEADER) leaderId = -1;
+        role = FOLLOWER;
+        leaderReady = false;
+        applyCv.notify_all();
+    }
+
+    // must be called with mu held
+    void becomeLeader() {
+        role = LEADER;
+        leaderId = id;
+        auto now = Clock::now();
+        for (auto& peer : peers) {
+            peer->next = lastIndex() + 1;
+            peer->match = 0;
+            peer->nextHeartbeat = now;
+            peer->lastAck = now;
+        }
+        // a majority just voted for this node
+        freshAt = now.time_since_epoch().count();
+        // entries from earlier terms only commit along with one from this term
+        csce438::RaftEntry noop;
+        noop.set_term(currentTerm);
+        append(noop);
+        advanceCommit();
+        applyCv.notify_all();
+        replicateCv.notify_all();
+    }
+
+    // the leader is current as of the latest time a majority (itself and the
+    // most recently answering peers) had answered. must be called with mu held
+    void updateLease() {
+        std::vector<Clock::time_point> acks;
+        for (auto& peer : peers) acks.push_back(peer->lastAck);
+        std::sort(acks.rbegin(), acks.rend());
+        size_t needed = addresses.size() / 2;
+        if (needed > 0) freshAt = acks[needed - 1].time_since_epoch().count();
+    }
+
+    // commits the newest entry of this term stored on a majority.
+    // must be called with mu held
+    void advanceCommit() {
+        for (uint64_t n = lastIndex(); n > commitIndex && log[n].term() == currentTerm; n--) {
+            size_t stored = 1;
+            for (auto& peer : peers) {
+                if (peer->match >= n) stored++;
+            }
+            if (stored * 2 > addresses.size()) {
+                commitIndex = n;
+                break;
+            }
+        }
+    }
+
+    void tick() {
+        std::unique_lock<std::mutex> lock(mu);
+        while (!stopped) {
+            if (role != LEADER && Clock::now() - lastContact >= electionTimeout) {
+                lock.unlock();
+                elect();
+                lock.lock();
+                continue;
+            }
+            // a leader cut off from the majority stops taking writes instead
+            // of accepting changes that can never commit
+            if (role == LEADER && staleness() > 2 * electionTimeout) stepDown(currentTerm);
+            lock.unlock();
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            lock.lock();
+        }
+    }
+
+    void elect() {
+        csce438::VoteRequest request;
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            lastContact = Clock::now();
+            resetElectionTimeout();
+            request.set_term(currentTerm + 1);
+            request.set_candidate(id);
+            request.set_last_log_index(lastIndex());
+            request.set_last_log_term(lastTerm());
+            request.set_pre_vote(true);
+        }
+        if (poll(request) * 2 <= addresses.size()) return;
+
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            if (role == LEADER || currentTerm + 1 != request.term()) return;
+            role = CANDIDATE;
+            currentTerm++;
+            votedFor = id;
+            leaderId = -1;
+            saveMeta();
+            lastContact = Clock::now();
+            resetElectionTimeout();
+            request.set_term(currentTerm);
+            request.set_candidate(id);
+            request.set_last_log_index(lastIndex());
+            request.set_last_log_term(lastTerm());
+            request.set_pre_vote(false);
+        }
+
+        size_t votes = poll(request);
+        std::lock_guard<std::mutex> lock(mu);
+        if (role == CANDIDATE && currentTerm == request.term() && votes * 2 > addresses.size()) {
+            becomeLeader();
+        }
+    }
+
+    // votes for `request`, this node's own included
+    size_t poll(const csce438::VoteRequest& request) {
+        std::atomic<size_t> votes{1};
+        std::vector<std::thread> voters;
+        for (auto& p : peers) {
+            Peer* peer = p.get();
+            voters.emplace_back([&, peer, this]() {
+                grpc::ClientContext context;
+                context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(electionTimeoutMs / 2));
+                csce438::VoteReply reply;
+                if (!peer->stub->RequestVote(&context, request, &reply).ok()) return;
+                std::lock_guard<std::mutex> lock(mu);
+                if (reply.term() > currentTerm) stepDown(reply.term());
+                else if (reply.granted()) votes++;
+            });
+        }
+        for (auto& v : voters) v.join();
+        return votes;
+    }
+
+    void replicate(size_t p) {
+        Peer& peer = *peers[p];
+        std::unique_lock<std::mutex> lock(mu);
+        while (!stopped) {
+            if (role != LEADER) {
+                replicateCv.wait(lock);
+                continue;
+            }
+            auto now = Clock::now();
+            if (peer.next > lastIndex() && now < peer.nextHeartbeat) {
+                replicateCv.wait_until(lock, peer.nextHeartbeat);
+                continue;
+            }
+
+            csce438::AppendRequest request;
+            request.set_term(currentTerm);
+            request.set_leader(id);
+            request.set_prev_log_index(peer.next - 1);
+            request.set_prev_log_term(log[peer.next - 1].term());
+            for (uint64_t i = peer.next; i <= lastIndex() && i < peer.next + MAX_ENTRIES_PER_APPEND; i++) {
+                *request.add_entries() = log[i];
+            }
+            request.set_leader_commit(commitIndex);
+            peer.nextHeartbeat = now + std::chrono::milliseconds(heartbeatMs);
+            lock.unlock();
+
+            grpc::ClientContext context;
+            context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(4 * heartbeatMs));
+            csce438::AppendReply reply;
+            grpc::Status status = peer.stub->AppendEntries(&context, request, &reply);
+            lock.lock();
+
+            if (!status.ok()) {
+                // unreachable: retry at the next heartbeat rather than spin
+                if (!stopped && role == LEADER) replicateCv.wait_until(lock, peer.nextHeartbeat);
+                continue;
+            }
+            if (reply.term() > currentTerm) {
+                stepDown(reply.term());
+                continue;
+            }
+            if (role != LEADER || currentTerm != request.term()) continue;
+            peer.lastAck = now;
+            updateLease();
+            if (reply.success()) {
+                peer.match = std::max<uint64_t>(peer.match, reply.match_index());
+                peer.next = peer.match + 1;
+                advanceCommit();
+            } else {
+                peer.next = std::max<uint64_t>(1, std::min<uint64_t>(peer.next - 1, reply.match_index() + 1));
+            }
+        }
+    }
+
+    // applies committed entries on followers, the whole log on a new
+    // leader, and resets the state of a leader that stepped down
+    void applyLoop() {
+        bool reported = false;
+        std::unique_lock<std::mutex> lock(mu);
+        while (!stopped) {
+            if (!leaderReady && (reported || lastApplied > commitIndex)) {
+                bool lost = reported;
+                reported = false;
+                lastApplied = 0;
+                lock.unlock();
+                if (lost) callbacks.leadership(false);
+                callbacks.reset();
+                lock.lock();
+            } else if (role == LEADER && !leaderReady) {
+                uint64_t term = currentTerm;
+                uint64_t upto = lastIndex();
+                std::vector<csce438::LogRecord> records = collect(upto);
+                lock.unlock();
+                if (!records.empty()) callbacks.apply(records);
+                lock.lock();
+                lastApplied = upto;
+                if (role == LEADER && currentTerm == term) {
+                    leaderReady = true;
+                    reported = true;
+                    lock.unlock();
+                    callbacks.leadership(true);
+                    lock.lock();
+                }
+            } else if (role != LEADER && lastApplied < commitIndex) {
+                uint64_t upto = commitIndex;
+                std::vector<csce438::LogRecord> records = collect(upto);
+                lock.unlock();
+                if (!records.empty()) callbacks.apply(records);
+                lock.lock();
+                lastApplied = upto;
+            } else {
+                applyCv.wait(lock);
+            }
+        }
+    }
+
+    // records after lastApplied up to `upto`, skipping no-ops.
+    // must be called with mu held
+    std::vector<csce438::LogRecord> collect(uint64_t upto) const {
+        std::vector<csce438::LogRecord> records;
+        for (uint64_t i = lastApplied + 1; i <= upto; i++) {
+            if (log[i].has_record()) records.push_back(log[i].record());
+        }
+        return records;
+    }
+
+    // ---- persistence. all of it runs with mu held ----
+
+    bool load() {
+        log.assign(1, csce438::RaftEntry());
+        offsets.assign(1, 0);
+        std::ifstream meta(dir + "/raft.meta");
+        if (meta) meta >> currentTerm >> votedFor;
+
+        std::string bytes;
+        {
+            std::ifstream in(dir + "/raft.log", std::ios::binary);
+            std::stringstream ss;
+            if (in) ss << in.rdbuf();
+            bytes = ss.str();
+        }
+        size_t good = 0;
+        while (good + 4 <= bytes.size()) {
+            uint32_t len = static_cast<uint8_t>(bytes[good]) | static_cast<uint8_t>(bytes[good + 1]) << 8 |
+                           static_cast<uint8_t>(bytes[good + 2]) << 16 | static_cast<uint32_t>(static_cast<uint8_t>(bytes[good + 3])) << 24;
+            if (good + 4 + len > bytes.size()) break;
+            csce438::RaftEntry entry;
+            if (!entry.ParseFromArray(bytes.data() + good + 4, len)) break;
+            log.push_back(entry);
+            offsets.push_back(good);
+            good += 4 + len;
+        }
+        fd = ::open((dir + "/raft.log").c_str(), O_WRONLY | O_CREAT, 0644);
+        if (fd < 0 || ftruncate(fd, good) != 0) return false;
+        fileEnd = good;
+        return true;
+    }
+
+    void saveMeta() {
+        std::string path = dir + "/raft.meta";
+        {
+            std::ofstream out(path + ".tmp", std::ios::trunc);
+            out << currentTerm << " " << votedFor << std::endl;
+        }
+        int tfd = ::open((path + ".tmp").c_str(), O_RDONLY);
+        if (tfd >= 0) {
+            fsync(tfd);
+            close(tfd);
+        }
+        rename((path + ".tmp").c_str(), path.c_str());
+    }
+
+    void append(const csce438::RaftEntry& entry) {
+        log.push_back(entry);
+        writeEntry(lastIndex());
+        if (fd >= 0) fdatasync(fd);
+    }
+
+    void writeEntry(uint64_t index) {
+        std::string body = log[index].SerializeAsString();
+        uint32_t len = body.size();
+        char header[4] = {static_cast<char>(len), static_cast<char>(len >> 8),
+                          static_cast<char>(len >> 16), static_cast<char>(len >> 24)};
+        std::string frame(header, 4);
+        frame += body;
+        offsets.resize(index + 1);
+        offsets[index] = fileEnd;
+        if (pwrite(fd, frame.data(), frame.size(), fileEnd) == static_cast<ssize_t>(frame.size())) {
+            fileEnd += frame.size();
+        }
+    }
+
+    // drops entries from `index` on
+    void truncate(uint64_t index) {
+        log.resize(index);
+        fileEnd = offsets[index];
+        offsets.resize(index);
+        if (ftruncate(fd, fileEnd) != 0) fileEnd = 0;
+    }
+
+    const int id;
+    const std::vector<std::string> addresses;
+    const std::string dir;
+    Callbacks callbacks;
+    const int electionTimeoutMs;
+    const int heartbeatMs;
+    std::mt19937 rng;
+
+    mutable std::mutex mu;
+    std::condition_variable applyCv;
+    std::condition_variable replicateCv;
+    bool stopped = false;
+    std::vector<std::thread> threads;
+    std::vector<std::unique_ptr<Peer>> peers;
+
+    Role role = FOLLOWER;
+    bool leaderReady = false;
+    int leaderId = -1;
+    uint64_t currentTerm = 0;
+    int votedFor = -1;
+    // log[0] is a sentinel with term 0
+    std::vector<csce438::RaftEntry> log;
+    uint64_t commitIndex = 0;
+    uint64_t lastApplied = 0;
+    // resets the election timer: a leader's append or a granted vote
+    Clock::time_point lastContact;
+    Clock::duration electionTimeout;
+    // when this node last knew it was current, see staleness()
+    std::atomic<Clock::rep> freshAt{0};
+
+    int fd = -1;
+    // byte offset of each entry in raft.log
+    std::vector<uint64_t> offsets;
+    uint64_t fileEnd = 0;
+};
+
+// gRPC front for a RaftNode
+class RaftServiceImpl final : public csce438::RaftService::Service {
+public:
+    explicit RaftServiceImpl(RaftNode& node) : node(node) {}
+
+    grpc::Status RequestVote(grpc::ServerContext* context, const csce438::VoteRequest* request, csce438::VoteReply* reply) override {
+        return node.requestVote(*request, reply);
+    }
+
+    grpc::Status AppendEntries(grpc::ServerContext* context, const csce438::AppendRequest* request, csce438::AppendReply* reply) override {
+        return node.appendEntries(*request, reply);
+    }
+
+private:
+    RaftNode& node;
+};
+
+#endif
@@ -0,0 +1,364 @@
+#include <algorithm>
+#include <unistd.h>
+#include <glog/logging.h>
+#include <google/protobuf/util/time_util.h>
+
+#include "sns_client.h"
+
+#define log(severity, msg) LOG(severity) << msg; google::FlushLogFiles(google::severity);
+
+using grpc::ClientContext;
+using grpc::ClientReader;
+using grpc::Status;
+using csce438::CoordService;
+using csce438::ID;
+using csce438::ListReply;
+using csce438::Message;
+using csce438::Request;
+using csce438::RoutingUpdate;
+using csce438::ServerInfo;
+using csce438::WatchRequest;
+namespace v2 = csce438::v2;
+
+SNSClient::SNSClient(const std::string& coordinator, const std::string& username)
+    : username_(username),
+      coordinator_(CoordService::NewStub(grpc::CreateChannel(coordinator, grpc::InsecureChannelCredentials()))) {}
+
+SNSClient::~SNSClient() {
+    closed = true;
+    {
+        std::lock_guard<std::mutex> lock(streamMutex);
+        if (streamContext) streamContext->TryCancel();
+    }
+    if (reader.joinable()) reader.join();
+    {
+        std::lock_guard<std::mutex> lock(stubMutex);
+        if (watchContext) watchContext->TryCancel();
+    }
+    if (watcher.joinable()) watcher.join();
+    drain();
+    cq.Shutdown();
+    if (pipeline.joinable()) pipeline.join();
+}
+
+int SNSClient::connect() {
+    ClientContext context;
+    ID clientId;
+    ServerInfo server;
+    clientId.set_id(std::stoi(username_));
+    Status status = coordinator_->GetServer(&context, clientId, &server);
+    if (!status.ok()) {
+        log(ERROR, "No server available: " + status.error_message());
+        return -1;
+    }
+    clusterId = server.clusterid();
+    switchServer(server);
+    IReply reply = login();
+    if (!reply.grpc_status.ok() || reply.comm_status == FAILURE_ALREADY_EXISTS) {
+        return -1;
+    }
+    watcher = std::thread(&SNSClient::watchMaster, this);
+    return 1;
+}
+
+std::shared_ptr<v2::SNSService::Stub> SNSClient::stub() {
+    std::lock_guard<std::mutex> lock(stubMutex);
+    return stub_;
+}
+
+void SNSClient::switchServer(const ServerInfo& server) {
+    auto serverAddress = server.hostname() + ":" + server.port();
+    log(INFO, "Connecting to server at " + serverAddress);
+    std::shared_ptr<v2::SNSService::Stub> next = v2::SNSService::NewStub(
+        grpc::CreateChannel(serverAddress, grpc::InsecureChannelCredentials()));
+    std::lock_guard<std::mutex> lock(stubMutex);
+    hostname = server.hostname();
+    port = server.port();
+    stub_ = next;
+}
+
+void SNSClient::onReconnect(ReconnectCallback callback) {
+    std::lock_guard<std::mutex> lock(stubMutex);
+    reconnected = callback;
+}
+
+// Follows the coordinator's routing updates for our cluster and moves to the
+// new master as soon as it is elected, instead of waiting for an RPC to fail.
+void SNSClient::watchMaster() {
+    WatchRequest request;
+    request.set_clusterid(clusterId);
+    while (!closed) {
+        ClientContext context;
+        {
+            //checked again under the lock the destructor cancels with, so a
+            //Watch is either seen by it or never started
+            std::lock_guard<std::mutex> lock(stubMutex);
+            if (closed) break;
+            watchContext = &context;
+        }
+        std::unique_ptr<ClientReader<RoutingUpdate>> updates(coordinator_->Watch(&context, request));
+        RoutingUpdate update;
+        while (updates->Read(&update)) {
+            for (auto& route : update.clusters()) {
+                if (route.clusterid() != clusterId || !route.has_master()) continue;
+                const ServerInfo& master = route.master();
+                ReconnectCallback callback;
+                {
+                    std::lock_guard<std::mutex> lock(stubMutex);
+                    if (master.hostname() == hostname && master.port() == port) continue;
+                    callback = reconnected;
+                }
+                if (callback) callback(master);
+                switchServer(master);
+                login();
+                //A demoted master may still be up; end the stream on it so
+                //readTimeline reopens it on the new one from lastSeq_
+                std::lock_guard<std::mutex> lock(streamMutex);
+                if (streamContext) streamContext->TryCancel();
+            }
+        }
+        Status status = updates->Finish();
+        {
+            std::lock_guard<std::mutex> lock(stubMutex);
+            watchContext = nullptr;
+        }
+        if (closed) break;
+        log(INFO, "Watch ended (" + status.error_message() + "), retrying");
+        sleep(1);
+    }
+}
+
+IReply SNSClient::login() {
+    Request request;
+    request.set_username(username_);
+    v2::Reply reply;
+    ClientContext context;
+
+    Status status = stub()->Login(&context, request, &reply);
+
+    IReply ire;
+    ire.grpc_status = status;
+    if (!reply.msg().empty()) {
+        log(INFO, "Login reply: " + reply.msg());
+    }
+    if (reply.status() == v2::STATUS_ALREADY_LOGGED_IN) {
+        ire.comm_status = FAILURE_ALREADY_EXISTS;
+    } else {
+        ire.comm_status = SUCCESS;
+    }
+    return ire;
+}
+
+IReply SNSClient::list() {
+    Request request;
+    request.set_username(username_);
+    ListReply list_reply;
+    ClientContext context;
+
+    Status status = stub()->List(&context, request, &list_reply);
+    IReply ire;
+    ire.grpc_status = status;
+    if (status.ok()) {
+        ire.comm_status = SUCCESS;
+        for (const std::string& s : list_reply.all_users()) {
+            ire.all_users.push_back(s);
+        }
+        for (const std::string& s : list_reply.followers()) {
+            ire.followers.push_back(s);
+        }
+    }
+    return ire;
+}
+
+static IReply followReply(const Status& status, const v2::Reply& reply) {
+    IReply ire;
+    ire.grpc_status = status;
+    switch (reply.status()) {
+    case v2::STATUS_OK:
+        ire.comm_status = SUCCESS;
+        break;
+    case v2::STATUS_INVALID_USERNAME:
+        ire.comm_status = FAILURE_INVALID_USERNAME;
+        break;
+    case v2::STATUS_ALREADY_FOLLOWING:
+        ire.comm_status = FAILURE_ALREADY_EXISTS;
+        break;
+    default:
+        ire.comm_status = FAILURE_UNKNOWN;
+    }
+    return ire;
+}
+
+static IReply unfollowReply(const Status& status, const v2::Reply& reply) {
+    IReply ire;
+    ire.grpc_status = status;
+    switch (reply.status()) {
+    case v2::STATUS_OK:
+        ire.comm_status = SUCCESS;
+        break;
+    case v2::STATUS_INVALID_USERNAME:
+        ire.comm_status = FAILURE_INVALID_USERNAME;
+        break;
+    case v2::STATUS_NOT_A_FOLLOWER:
+        ire.comm_status = FAILURE_NOT_A_FOLLOWER;
+        break;
+    default:
+        ire.comm_status = FAILURE_UNKNOWN;
+    }
+    return ire;
+}
+
+IReply SNSClient::follow(const std::string& user) {
+    Request request;
+    request.set_username(username_);
+    request.add_arguments(user);
+    v2::Reply reply;
+    ClientContext context;
+
+    Status status = stub()->Follow(&context, request, &reply);
+    return followReply(status, reply);
+}
+
+IReply SNSClient::unfollow(const std::string& user) {
+    Request request;
+    request.set_username(username_);
+    request.add_arguments(user);
+    v2::Reply reply;
+    ClientContext context;
+
+    Status status = stub()->UnFollow(&context, request, &reply);
+    return unfollowReply(status, reply);
+}
+
+struct SNSClient::Call {
+    ClientContext context;
+    std::unique_ptr<grpc::ClientAsyncResponseReader<v2::Reply>> rpc;
+    v2::Reply reply;
+    Status status;
+    bool follow;
+    std::string target;
+    ReplyCallback done;
+};
+
+void SNSClient::followAsync(const std::string& user, ReplyCallback done) {
+    sendAsync(true, user, done);
+}
+
+void SNSClient::unfollowAsync(const std::string& user, ReplyCallback done) {
+    sendAsync(false, user, done);
+}
+
+void SNSClient::setWindow(int window) {
+    std::lock_guard<std::mutex> lock(pipelineMutex);
+    window_ = std::max(1, window);
+    pipelineChanged.notify_all();
+}
+
+void SNSClient::drain() {
+    std::unique_lock<std::mutex> lock(pipelineMutex);
+    pipelineChanged.wait(lock, [this] { return inFlight == 0; });
+}
+
+void SNSClient::sendAsync(bool follow, const std::string& user, ReplyCallback done) {
+    {
+        std::unique_lock<std::mutex> lock(pipelineMutex);
+        if (!pipeline.joinable()) pipeline = std::thread(&SNSClient::completeCalls, this);
+        //the server may apply concurrent calls in any order, so one target has one call at a time
+        pipelineChanged.wait(lock, [&] { return inFlight < window_ && !inFlightTargets.count(user); });
+        inFlight++;
+        inFlightTargets.insert(user);
+    }
+    Request request;
+    request.set_username(username_);
+    request.add_arguments(user);
+    Call* call = new Call();
+    call->follow = follow;
+    call->target = user;
+    call->done = done;
+    auto server = stub();
+    call->rpc = follow ? server->PrepareAsyncFollow(&call->context, request, &cq)
+                       : server->PrepareAsyncUnFollow(&call->context, request, &cq);
+    call->rpc->StartCall();
+    call->rpc->Finish(&call->reply, &call->status, call);
+}
+
+void SNSClient::completeCalls() {
+    void* tag;
+    bool ok;
+    while (cq.Next(&tag, &ok)) {
+        std::unique_ptr<Call> call(static_cast<Call*>(tag));
+        if (call->done) {
+            call->done(call->follow ? followReply(call->status, call->reply)
+                                    : unfollowReply(call->status, call->reply));
+        }
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        inFlight--;
+        inFlightTargets.erase(inFlightTargets.find(call->target));
+        pipelineChanged.notify_all();
+    }
+}
+
+void SNSClient::subscribe(PostCallback callback, uint64_t lastSeq) {
+    lastSeq_ = lastSeq;
+    openStream();
+    reader = std::thread(&SNSClient::readTimeline, this, callback);
+}
+
+// opens a stream on the current master, bound to the user once so posts
+// don't carry the username, and resuming after the last post received
+std::shared_ptr<SNSClient::Stream> SNSClient::openStream() {
+    auto context = std::make_unique<ClientContext>();
+    auto server = stub();
+    std::lock_guard<std::mutex> lock(streamMutex);
+    if (closed) return nullptr;
+    std::shared_ptr<Stream> next(server->Timeline(context.get()));
+    v2::TimelineRequest request;
+    request.mutable_set_stream()->set_username(username_);
+    request.mutable_set_stream()->set_last_seq(lastSeq_);
+    next->Write(request);
+    stream = next;
+    streamContext = std::move(context);
+    return next;
+}
+
+bool SNSClient::post(const std::string& msg) {
+    v2::TimelineRequest request;
+    v2::Post* post = request.mutable_post();
+    post->set_msg(msg);
+    *post->mutable_timestamp() = google::protobuf::util::TimeUtil::GetCurrentTime();
+    std::lock_guard<std::mutex> lock(streamMutex);
+    return stream && stream->Write(request);
+}
+
+void SNSClient::readTimeline(PostCallback callback) {
+    std::shared_ptr<Stream> current;
+    {
+        std::lock_guard<std::mutex> lock(streamMutex);
+        current = stream;
+    }
+    while (current) {
+        v2::TimelineEvent event;
+        while (current->Read(&event)) {
+            if (event.kind_case() == v2::TimelineEvent::kPost) {
+                lastSeq_ = event.post().seq();
+                callback(event.post());
+            } else if (event.kind_case() == v2::TimelineEvent::kBatch) {
+                for (const Message& m : event.batch().messages()) {
+                    lastSeq_ = m.seq();
+                    callback(m);
+                }
+            }
+        }
+        if (closed) return;
+        //The server went away; by now the watcher has usually switched masters
+        log(INFO, "Timeline stream closed, reopening");
+        sleep(1);
+        {
+            //the old call has to go before openStream() replaces the context it runs on
+            std::lock_guard<std::mutex> lock(streamMutex);
+            stream.reset();
+        }
+        current.reset();
+        current = openStream();
+    }
+}
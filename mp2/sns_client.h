@@ -0,0 +1,116 @@
+#ifndef SNS_CLIENT_H
+#define SNS_CLIENT_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <grpc++/grpc++.h>
+
+#include "client.h"
+#include "coordinator.grpc.pb.h"
+#include "sns_v2.grpc.pb.h"
+
+// The client side of the SNS service with no terminal I/O, for tsc and for
+// programs that drive users themselves (bots, replays, load generators).
+//
+// connect() asks the coordinator for the user's server, logs in and then
+// follows the cluster's routing updates, moving to a new master as soon as it
+// is elected. subscribe() opens the Timeline stream and hands every post to a
+// callback on a reader thread; a stream that fails is reopened after the last
+// post received, so nothing in between is lost.
+//
+// followAsync() and unfollowAsync() pipeline those commands for bulk work:
+// up to setWindow() of them are in flight at once, so a batch costs about one
+// round trip per window instead of one per command. A command waits for an
+// earlier one on the same target to finish, so FOLLOW x then UNFOLLOW x
+// still lands in order; commands on different targets may complete in any
+// order.
+class SNSClient {
+public:
+    typedef std::function<void(const csce438::Message&)> PostCallback;
+    typedef std::function<void(const csce438::ServerInfo&)> ReconnectCallback;
+    typedef std::function<void(const IReply&)> ReplyCallback;
+
+    // coordinator is "host:port"
+    SNSClient(const std::string& coordinator, const std::string& username);
+    ~SNSClient();
+
+    // 1 once logged in, -1 if no server is available or the user already
+    // has a session
+    int connect();
+    IReply login();
+    IReply list();
+    IReply follow(const std::string& user);
+    IReply unfollow(const std::string& user);
+
+    // send without waiting for the reply; done runs on the pipeline thread.
+    // blocks while the window is full
+    void followAsync(const std::string& user, ReplyCallback done);
+    void unfollowAsync(const std::string& user, ReplyCallback done);
+    // commands kept in flight by the async calls (default 64)
+    void setWindow(int window);
+    // waits until every async command has completed
+    void drain();
+
+    // called from the watcher thread after moving to a new master
+    void onReconnect(ReconnectCallback callback);
+    // opens the Timeline stream, asking for the posts after lastSeq (0 for
+    // the newest 20). one subscription per client
+    void subscribe(PostCallback callback, uint64_t lastSeq = 0);
+    // posts over the Timeline stream; false before subscribe() or while the
+    // stream is being reopened
+    bool post(const std::string& msg);
+    // seq of the last post handed to the callback
+    uint64_t lastSeq() const { return lastSeq_; }
+    const std::string& username() const { return username_; }
+
+private:
+    typedef grpc::ClientReaderWriter<csce438::v2::TimelineRequest, csce438::v2::TimelineEvent> Stream;
+
+    std::shared_ptr<csce438::v2::SNSService::Stub> stub();
+    void switchServer(const csce438::ServerInfo& server);
+    void watchMaster();
+    std::shared_ptr<Stream> openStream();
+    void readTimeline(PostCallback callback);
+    void sendAsync(bool follow, const std::string& user, ReplyCallback done);
+    void completeCalls();
+
+    std::string username_;
+    int clusterId = 0;
+    std::unique_ptr<csce438::CoordService::Stub> coordinator_;
+    std::atomic<bool> closed{false};
+
+    // replaced by the watcher when the cluster's master changes
+    std::mutex stubMutex;
+    std::shared_ptr<csce438::v2::SNSService::Stub> stub_;
+    std::string hostname;
+    std::string port;
+    ReconnectCallback reconnected;
+    grpc::ClientContext* watchContext = nullptr;
+    std::thread watcher;
+
+    // the Timeline stream currently open
+    std::mutex streamMutex;
+    std::unique_ptr<grpc::ClientContext> streamContext;
+    std::shared_ptr<Stream> stream;
+    std::atomic<uint64_t> lastSeq_{0};
+    std::thread reader;
+
+    // async Follow/UnFollow calls, completed on the pipeline thread
+    struct Call;
+    std::mutex pipelineMutex;
+    std::condition_variable pipelineChanged;
+    int window_ = 64;
+    int inFlight = 0;
+    std::multiset<std::string> inFlightTargets;
+    grpc::CompletionQueue cq;
+    std::thread pipeline;
+};
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef STATE_LOG_H
+#define STATE_LOG_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "coordinator.pb.h"
+
+// On-disk copy of the coordinator's state: a snapshot plus an append log of
+// the changes made since.
+//
+// Log records are LogRecords, each prefixed with its length as 4 little
+// endian bytes, appended to <dir>/coordinator.log. A snapshot goes to a temp
+// file that is renamed over <dir>/coordinator.snapshot, after which the log
+// starts over. Replaying a record twice is harmless, so a crash between the
+// rename and the truncate only costs a longer replay.
+//
+// Appends are not fsync'd: a server missing from the log re-registers with
+// its next heartbeat, so losing the tail of the log after a machine crash
+// only costs those servers their warm start.
+class StateLog {
+public:
+    ~StateLog() {
+        if (fd >= 0) close(fd);
+    }
+
+    // loads the snapshot and the log records after it and opens the log for
+    // appending. a torn record at the end of the log is cut off
+    bool open(const std::string& dir, csce438::CoordSnapshot* snapshot, std::vector<csce438::LogRecord>* records) {
+        logPath = dir + "/coordinator.log";
+        snapshotPath = dir + "/coordinator.snapshot";
+
+        std::string bytes;
+        if (readFile(snapshotPath, &bytes) && !snapshot->ParseFromString(bytes)) return false;
+
+        size_t good = 0;
+        bytes.clear();
+        if (readFile(logPath, &bytes)) {
+            while (good + 4 <= bytes.size()) {
+                uint32_t len = static_cast<uint8_t>(bytes[good]) | static_cast<uint8_t>(bytes[good + 1]) << 8 |
+                               static_cast<uint8_t>(bytes[good + 2]) << 16 | static_cast<uint32_t>(static_cast<uint8_t>(bytes[good + 3])) << 24;
+                if (good + 4 + len > bytes.size()) break;
+                csce438::LogRecord record;
+                if (!record.ParseFromArray(bytes.data() + good + 4, len)) break;
+                records->push_back(record);
+                good += 4 + len;
+            }
+        }
+        count = records->size();
+
+        fd = ::open(logPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) return false;
+        return ftruncate(fd, good) == 0;
+    }
+
+    bool append(const csce438::LogRecord& record) {
+        std::string body = record.SerializeAsString();
+        uint32_t len = body.size();
+        char header[4] = {static_cast<char>(len), static_cast<char>(len >> 8),
+                          static_cast<char>(len >> 16), static_cast<char>(len >> 24)};
+        // one write per record, so a crash can only tear the last one
+        std::string frame(header, 4);
+        frame += body;
+        count++;
+        return write(fd, frame.data(), frame.size()) == static_cast<ssize_t>(frame.size());
+    }
+
+    // records appended since the last snapshot
+    size_t records() const { return count; }
+
+    bool writeSnapshot(const csce438::CoordSnapshot& snapshot) {
+        std::string tmp = snapshotPath + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+            if (!snapshot.SerializeToOstream(&out)) return false;
+            out.flush();
+            if (!out) return false;
+        }
+        int tfd = ::open(tmp.c_str(), O_RDONLY);
+        if (tfd >= 0) {
+            fsync(tfd);
+            close(tfd);
+        }
+        if (rename(tmp.c_str(), snapshotPath.c_str()) != 0) return false;
+        count = 0;
+        return ftruncate(fd, 0) == 0;
+    }
+
+private:
+    static bool readFile(const std::string& path, std::string* bytes) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) return false;
+        std::stringstream ss;
+        ss << in.rdbuf();
+        *bytes = ss.str();
+        return true;
+    }
+
+    std::string logPath;
+    std::string snapshotPath;
+    int fd = -1;
+    size_t count = 0;
+};
+
+#endif
@@ -0,0 +1,674 @@
+// Cross-cluster synchronizer: lets users follow and read users homed on
+// other clusters. Run one per cluster next to its master:
+//
+//   ./synchronizer -c 1 -d cluster1 -p 9001 -a 127.0.0.1 -h 127.0.0.1 -k 3010
+//
+// -c cluster, -d the master's timeline directory (tsd -d), -p port to listen
+// on, -a host other synchronizers reach this one at, -h/-k the coordinator.
+//
+// The directory is watched with inotify, and only what was appended to a
+// file since the last read is shipped. How far each file has been shipped
+// is kept in synchronizer.offsets, so a restart picks up where it left off:
+//   users.txt           users created here, sent to every other cluster
+//   remote_follows.txt  follows of remote users, sent to the followee's cluster
+//   <user>.txt          posts written by <user>, sent to the master of every
+//                       cluster with followers of <user>
+// Users from other clusters go to remote_users.txt, where tsd looks up the
+// remote users its users follow. Follows from other clusters go to
+// remote_followers.txt, which only the synchronizer reads: it is how it
+// knows, across restarts, which clusters to send each local user's posts to.
+//
+// Posts never go through a file on the receiving side. They travel in one
+// DeliverBatch per cluster per round, each post listed once with all of its
+// recipients there, over one long-lived channel per cluster master, which
+// adds them to the recipients' timelines.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <glog/logging.h>
+#include <google/protobuf/util/time_util.h>
+#include <grpc++/grpc++.h>
+
+#include "coordinator.grpc.pb.h"
+#include "peer.grpc.pb.h"
+
+#define log(severity, msg) LOG(severity) << msg; google::FlushLogFiles(google::severity);
+
+using grpc::ClientContext;
+using grpc::Server;
+using grpc::ServerBuilder;
+using grpc::ServerContext;
+using grpc::Status;
+using csce438::Confirmation;
+using csce438::CoordService;
+using csce438::ID;
+using csce438::Path;
+using csce438::PathAndData;
+using csce438::RoutingUpdate;
+using csce438::ServerInfo;
+using csce438::SynchBatch;
+using csce438::SynchService;
+using csce438::WatchRequest;
+namespace peer = csce438::peer;
+
+const std::string USERS_FILE = "users.txt";
+const std::string REMOTE_USERS_FILE = "remote_users.txt";
+const std::string REMOTE_FOLLOWS_FILE = "remote_follows.txt";
+// "+follower followee cluster" or "-follower followee cluster" per line
+const std::string REMOTE_FOLLOWERS_FILE = "remote_followers.txt";
+// "<file> <position>" per line, positions counting bytes compaction has cut
+const std::string OFFSETS_FILE = "synchronizer.offsets";
+const std::string REGISTRY = "/synchronizers";
+// deadline on every call, so a peer or master that hangs holds up the loop
+// for a round rather than stopping replication to every cluster
+const std::chrono::milliseconds RPC_TIMEOUT(2000);
+
+int cluster_id = 1;
+std::string data_dir = ".";
+std::unique_ptr<CoordService::Stub> coordinator;
+
+// shared between the inotify loop and Push handlers
+std::mutex state_mutex;
+std::set<std::string> local_users;
+std::set<std::string> remote_users;
+// local user -> cluster -> users of that cluster following them
+std::map<std::string, std::map<int, std::set<std::string>>> remote_followers;
+// clusters known to the coordinator, and those not yet sent our users
+std::set<int> clusters;
+std::set<int> new_clusters;
+// host:port of each cluster's master
+std::map<int, std::string> masters;
+// posts shipped and who they were for, counted under state_mutex
+long shipped_posts = 0;
+long shipped_recipients = 0;
+long delivery_rpcs = 0;
+
+// only used by the inotify loop
+std::map<std::string, off_t> offsets;
+// whether offsets moved since they were last saved
+bool offsets_changed = false;
+// bytes tsd's compaction had cut from the front of each file when we last
+// looked, from <file>.trimmed
+std::map<std::string, off_t> trimmed;
+std::map<std::string, int> user_clusters;
+std::map<int, std::unique_ptr<SynchService::Stub>> peers;
+// channel to each cluster's master, replaced when the master moves
+struct MasterChannel {
+    std::string address;
+    std::unique_ptr<peer::PeerService::Stub> stub;
+};
+std::map<int, MasterChannel> master_channels;
+// batches waiting to be sent, kept until the peer takes them
+std::map<int, SynchBatch> outgoing;
+std::map<int, peer::DeliveryBatch> deliveries;
+// follow lines whose followee's cluster couldn't be looked up yet
+std::vector<std::string> unresolved_follows;
+
+void setDeadline(ClientContext& context) {
+    context.set_deadline(std::chrono::system_clock::now() + RPC_TIMEOUT);
+}
+
+void appendLine(const std::string& name, const std::string& data) {
+    int fd = open((data_dir + "/" + name).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        log(ERROR, "Cannot open " + name);
+        return;
+    }
+    // one write, so tsd never sees half a record
+    if (write(fd, data.data(), data.size()) != static_cast<ssize_t>(data.size())) {
+        log(ERROR, "Short write to " + name);
+    }
+    close(fd);
+}
+
+std::vector<std::string> readLines(const std::string& name) {
+    std::vector<std::string> lines;
+    std::ifstream in(data_dir + "/" + name);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty()) lines.push_back(line);
+    }
+    return lines;
+}
+
+off_t readTrimmed(const std::string& name) {
+    off_t cut = 0;
+    std::ifstream(data_dir + "/" + name + ".trimmed") >> cut;
+    return cut;
+}
+
+// the complete lines appended to the file since the last call, and where
+// in the file they start
+std::string readAppended(const std::string& name, off_t* start = nullptr) {
+    std::string path = data_dir + "/" + name;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return "";
+    struct stat st;
+    fstat(fd, &st);
+    off_t& offset = offsets[name];
+    if (st.st_size < offset) offset = st.st_size;
+    if (start) *start = offset;
+    std::string data(st.st_size - offset, '\0');
+    ssize_t n = data.empty() ? 0 : pread(fd, &data[0], data.size(), offset);
+    close(fd);
+    data.resize(n < 0 ? 0 : n);
+    size_t end = data.rfind('\n');
+    if (end == std::string::npos) return "";
+    data.resize(end + 1);
+    offset += data.size();
+    offsets_changed = true;
+    return data;
+}
+
+// splits timeline data into "<time> :: <user>:<msg>" records, each with the
+// blank lines that follow it
+std::vector<std::string> splitRecords(const std::string& data) {
+    std::vector<std::string> records;
+    size_t pos = 0;
+    while (pos < data.size()) {
+        size_t start = pos;
+        pos = data.find('\n', pos);
+        pos = (pos == std::string::npos) ? data.size() : pos + 1;
+        while (pos < data.size() && data[pos] == '\n') pos++;
+        records.push_back(data.substr(start, pos - start));
+    }
+    return records;
+}
+
+// the post a record was written for
+bool parseRecord(const std::string& record, csce438::Message* post) {
+    size_t sep = record.find(" :: ");
+    size_t colon = sep == std::string::npos ? sep : record.find(':', sep + 4);
+    if (colon == std::string::npos ||
+        !google::protobuf::util::TimeUtil::FromString(record.substr(0, sep), post->mutable_timestamp())) {
+        return false;
+    }
+    post->set_username(record.substr(sep + 4, colon - sep - 4));
+    // tsd ends the record with a newline after the message
+    post->set_msg(record.substr(colon + 1, record.size() - colon - 2));
+    return true;
+}
+
+// home cluster of a user, -1 if the coordinator can't say right now
+int clusterOf(const std::string& user) {
+    auto it = user_clusters.find(user);
+    if (it != user_clusters.end()) return it->second;
+    ID id;
+    try {
+        id.set_id(std::stoi(user));
+    } catch (const std::exception&) {
+        return -1;
+    }
+    ClientContext context;
+    setDeadline(context);
+    ServerInfo server;
+    if (!coordinator->GetServer(&context, id, &server).ok()) return -1;
+    user_clusters[user] = server.clusterid();
+    return server.clusterid();
+}
+
+SynchService::Stub* peerFor(int cluster) {
+    auto it = peers.find(cluster);
+    if (it != peers.end()) return it->second.get();
+    Path path;
+    path.set_path(REGISTRY + "/" + std::to_string(cluster));
+    ClientContext context;
+    setDeadline(context);
+    csce438::Status status;
+    if (!coordinator->exists(&context, path, &status).ok() || !status.status()) return nullptr;
+    log(INFO, "Cluster " + std::to_string(cluster) + " synchronizer is at " + status.data());
+    auto& stub = peers[cluster];
+    stub = SynchService::NewStub(grpc::CreateChannel(status.data(), grpc::InsecureChannelCredentials()));
+    return stub.get();
+}
+
+peer::PeerService::Stub* masterFor(int cluster) {
+    std::string address;
+    {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        auto it = masters.find(cluster);
+        if (it == masters.end()) return nullptr;
+        address = it->second;
+    }
+    MasterChannel& channel = master_channels[cluster];
+    if (channel.address != address) {
+        channel.address = address;
+        channel.stub = peer::PeerService::NewStub(grpc::CreateChannel(address, grpc::InsecureChannelCredentials()));
+    }
+    return channel.stub.get();
+}
+
+SynchBatch& batchFor(int cluster) {
+    SynchBatch& batch = outgoing[cluster];
+    batch.set_clusterid(cluster_id);
+    return batch;
+}
+
+void shipUsers(const std::vector<std::string>& users) {
+    std::lock_guard<std::mutex> lock(state_mutex);
+    for (auto& user : users) {
+        local_users.insert(user);
+        for (int c : clusters) {
+            if (c != cluster_id) batchFor(c).add_users(user);
+        }
+    }
+}
+
+// a "+follower followee" or "-follower followee" line. false if the
+// followee's cluster is unknown for now
+bool shipFollow(const std::string& line) {
+    if (line.empty()) return true;
+    std::istringstream in(line.substr(1));
+    std::string follower, followee;
+    if (!(in >> follower >> followee)) return true;
+    bool follow = line[0] == '+';
+    int cluster = clusterOf(followee);
+    if (cluster < 0) return false;
+    if (cluster == cluster_id) return true;
+    auto* relation = batchFor(cluster).add_follows();
+    relation->set_follower(follower);
+    relation->set_followee(followee);
+    relation->set_follow(follow);
+    return true;
+}
+
+// data was read from offset in the user's timeline file, of which
+// compaction has cut trimmed bytes so far
+void shipPosts(const std::string& user, const std::string& data, off_t offset) {
+    std::lock_guard<std::mutex> lock(state_mutex);
+    auto followers = remote_followers.find(user);
+    if (followers == remote_followers.end()) return;
+    off_t position = trimmed[user + ".txt"] + offset;
+    for (auto& record : splitRecords(data)) {
+        off_t at = position;
+        position += record.size();
+        csce438::Message post;
+        // the file also holds posts by the people the user follows
+        if (!parseRecord(record, &post) || post.username() != user) continue;
+        std::string id = std::to_string(cluster_id) + ":" + user + ":" + std::to_string(at);
+        for (auto& cluster : followers->second) {
+            if (cluster.second.empty()) continue;
+            peer::Delivery* delivery = deliveries[cluster.first].add_deliveries();
+            *delivery->mutable_post() = post;
+            delivery->set_id(id);
+            for (auto& follower : cluster.second) delivery->add_recipients(follower);
+            shipped_posts++;
+            shipped_recipients += cluster.second.size();
+        }
+    }
+}
+
+void processFile(const std::string& name, bool replaced) {
+    if (name == USERS_FILE) {
+        std::vector<std::string> users;
+        std::istringstream in(readAppended(name));
+        std::string line;
+        while (std::getline(in, line)) {
+            if (!line.empty()) users.push_back(line);
+        }
+        shipUsers(users);
+    } else if (name == REMOTE_FOLLOWS_FILE) {
+        std::istringstream in(readAppended(name));
+        std::string line;
+        while (std::getline(in, line)) {
+            if (!shipFollow(line)) unresolved_follows.push_back(line);
+        }
+    } else if (name.size() > 4 && name.compare(name.size() - 4, 4, ".txt") == 0) {
+        std::string user = name.substr(0, name.size() - 4);
+        {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            if (!local_users.count(user)) return;
+        }
+        if (replaced) {
+            // tsd compacted the file: what we hadn't read yet was carried
+            // over to the end of the new one, which starts cut bytes later
+            off_t now = readTrimmed(name);
+            off_t cut = now - trimmed[name];
+            trimmed[name] = now;
+            offsets[name] = std::max<off_t>(0, offsets[name] - cut);
+            offsets_changed = true;
+        }
+        off_t start = 0;
+        std::string data = readAppended(name, &start);
+        shipPosts(user, data, start);
+    }
+}
+
+// sends every pending batch, keeping those a peer didn't take for the next round
+void flush() {
+    for (auto it = outgoing.begin(); it != outgoing.end();) {
+        SynchService::Stub* peer = peerFor(it->first);
+        if (!peer) {
+            ++it;
+            continue;
+        }
+        ClientContext context;
+        setDeadline(context);
+        Confirmation reply;
+        Status status = peer->Push(&context, it->second, &reply);
+        if (!status.ok()) {
+            log(WARNING, "Push to cluster " + std::to_string(it->first) + " failed: " + status.error_message());
+            // the synchronizer may have moved; look it up again next round
+            peers.erase(it->first);
+            ++it;
+            continue;
+        }
+        it = outgoing.erase(it);
+    }
+    for (auto it = deliveries.begin(); it != deliveries.end();) {
+        peer::PeerService::Stub* master = masterFor(it->first);
+        if (!master) {
+            ++it;
+            continue;
+        }
+        // a batch that timed out may have been applied; resending it is
+        // safe since the master skips delivery ids it has seen
+        ClientContext context;
+        setDeadline(context);
+        peer::DeliveryAck ack;
+        Status status = master->DeliverBatch(&context, it->second, &ack);
+        if (!status.ok()) {
+            log(WARNING, "DeliverBatch to cluster " + std::to_string(it->first) + " failed: " + status.error_message());
+            ++it;
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            delivery_rpcs++;
+        }
+        it = deliveries.erase(it);
+    }
+}
+
+// positions saved by saveOffsets, empty if there is no offsets file
+std::map<std::string, off_t> loadOffsets() {
+    std::map<std::string, off_t> positions;
+    for (auto& line : readLines(OFFSETS_FILE)) {
+        std::istringstream in(line);
+        std::string name;
+        off_t position;
+        if (in >> name >> position) positions[name] = position;
+    }
+    return positions;
+}
+
+// records how far every file has been shipped. only called with nothing
+// left to deliver, so a restart never skips posts that didn't get through
+void saveOffsets() {
+    std::string path = data_dir + "/" + OFFSETS_FILE;
+    {
+        std::ofstream out(path + ".tmp", std::ios::trunc);
+        for (auto& o : offsets) out << o.first << " " << trimmed[o.first] + o.second << "\n";
+        if (!out) {
+            log(ERROR, "Cannot write " + OFFSETS_FILE);
+            return;
+        }
+    }
+    if (rename((path + ".tmp").c_str(), path.c_str()) != 0) {
+        log(ERROR, "Cannot replace " + OFFSETS_FILE);
+        return;
+    }
+    offsets_changed = false;
+}
+
+class SynchServiceImpl final : public SynchService::Service {
+    Status Push(ServerContext* context, const SynchBatch* batch, Confirmation* reply) override {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        for (auto& user : batch->users()) {
+            if (!local_users.count(user) && remote_users.insert(user).second) {
+                appendLine(REMOTE_USERS_FILE, user + "\n");
+            }
+        }
+        for (auto& f : batch->follows()) {
+            auto& followers = remote_followers[f.followee()][batch->clusterid()];
+            if (f.follow() ? followers.insert(f.follower()).second : followers.erase(f.follower()) > 0) {
+                appendLine(REMOTE_FOLLOWERS_FILE, (f.follow() ? "+" : "-") + f.follower() + " " + f.followee()
+                           + " " + std::to_string(batch->clusterid()) + "\n");
+            }
+        }
+        reply->set_status(true);
+        return Status::OK;
+    }
+};
+
+// keeps `clusters` current and queues our users for clusters seen for the first time
+void WatchClusters() {
+    while (true) {
+        ClientContext context;
+        WatchRequest request;
+        request.set_clusterid(0);
+        std::unique_ptr<grpc::ClientReader<RoutingUpdate>> reader(coordinator->Watch(&context, request));
+        RoutingUpdate update;
+        while (reader->Read(&update)) {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            masters.clear();
+            for (auto& route : update.clusters()) {
+                if (clusters.insert(route.clusterid()).second && route.clusterid() != cluster_id) {
+                    new_clusters.insert(route.clusterid());
+                }
+                if (route.has_master()) {
+                    masters[route.clusterid()] = route.master().hostname() + ":" + route.master().port();
+                }
+            }
+        }
+        reader->Finish();
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+}
+
+// records this synchronizer's address under /synchronizers/<cluster>
+void Register(const std::string& address) {
+    while (true) {
+        PathAndData request;
+        request.set_path(REGISTRY);
+        csce438::Status result;
+        {
+            ClientContext context;
+            setDeadline(context);
+            coordinator->create(&context, request, &result);
+        }
+        request.set_path(REGISTRY + "/" + std::to_string(cluster_id));
+        request.set_data(address);
+        ClientContext context;
+        setDeadline(context);
+        if (coordinator->create(&context, request, &result).ok()) {
+            if (result.status()) {
+                log(INFO, "Registered as " + request.path() + " at " + address);
+                return;
+            }
+            Path path;
+            path.set_path(request.path());
+            ClientContext existsContext;
+            setDeadline(existsContext);
+            if (coordinator->exists(&existsContext, path, &result).ok() && result.status()) {
+                if (result.data() != address) {
+                    log(WARNING, request.path() + " already names " + result.data() + ", not " + address);
+                }
+                return;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+}
+
+// logs how many posts went out and how many RPCs carried them. delivery
+// latency is logged by the receiving masters
+void ReportStats() {
+    const int interval = 10;
+    while (true) {
+        sleep(interval);
+        std::lock_guard<std::mutex> lock(state_mutex);
+        log(INFO, "Synchronizer: shipped " + std::to_string(shipped_posts) + " posts to "
+            + std::to_string(shipped_recipients) + " remote followers in " + std::to_string(delivery_rpcs)
+            + " DeliverBatch calls");
+        shipped_posts = 0;
+        shipped_recipients = 0;
+        delivery_rpcs = 0;
+    }
+}
+
+void RunSynchronizer(const std::string& port, const std::string& address) {
+    // earlier state, then only what is appended from here on
+    for (auto& user : readLines(REMOTE_USERS_FILE)) remote_users.insert(user);
+    for (auto& line : readLines(REMOTE_FOLLOWERS_FILE)) {
+        std::istringstream in(line.substr(1));
+        std::string follower, followee;
+        int cluster;
+        if (!(in >> follower >> followee >> cluster)) continue;
+        auto& followers = remote_followers[followee][cluster];
+        if (line[0] == '+') {
+            followers.insert(follower);
+        } else {
+            followers.erase(follower);
+        }
+    }
+    // files are shipped on from where the last run got to. on a first run
+    // only what is appended from now on is shipped; on later ones, files
+    // that appeared while we were down are shipped from the start
+    std::error_code ec;
+    bool first_run = !std::filesystem::exists(data_dir + "/" + OFFSETS_FILE, ec);
+    std::map<std::string, off_t> saved = loadOffsets();
+    for (auto& entry : std::filesystem::directory_iterator(data_dir, ec)) {
+        std::string name = entry.path().filename().string();
+        if (name != USERS_FILE && name != REMOTE_FOLLOWS_FILE) {
+            trimmed[name] = readTrimmed(name);
+            auto it = saved.find(name);
+            if (it != saved.end()) {
+                offsets[name] = std::max<off_t>(0, it->second - trimmed[name]);
+            } else {
+                offsets[name] = first_run ? entry.file_size(ec) : 0;
+            }
+        }
+    }
+    if (first_run) saveOffsets();
+
+    int fd = inotify_init1(IN_NONBLOCK);
+    if (fd < 0 || inotify_add_watch(fd, data_dir.c_str(), IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        log(ERROR, "Cannot watch " + data_dir);
+        return;
+    }
+
+    SynchServiceImpl service;
+    ServerBuilder builder;
+    builder.AddListeningPort("0.0.0.0:" + port, grpc::InsecureServerCredentials());
+    builder.RegisterService(&service);
+    std::unique_ptr<Server> server(builder.BuildAndStart());
+    log(INFO, "Synchronizer for cluster " + std::to_string(cluster_id) + " listening on " + port
+        + ", watching " + data_dir);
+
+    Register(address);
+    std::thread watcher(WatchClusters);
+    std::thread stats(ReportStats);
+
+    // users and follows are replayed in full; receivers ignore what they have
+    processFile(USERS_FILE, false);
+    processFile(REMOTE_FOLLOWS_FILE, false);
+    // then posts written while we were down
+    std::vector<std::string> names;
+    for (auto& o : offsets) names.push_back(o.first);
+    for (auto& name : names) processFile(name, false);
+
+    std::vector<char> buffer(64 * 1024);
+    while (true) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        poll(&pfd, 1, 1000);
+
+        // file names in the order they changed, each once
+        std::vector<std::pair<std::string, bool>> changed;
+        ssize_t n;
+        while ((n = read(fd, buffer.data(), buffer.size())) > 0) {
+            for (char* p = buffer.data(); p < buffer.data() + n;) {
+                auto* event = reinterpret_cast<struct inotify_event*>(p);
+                p += sizeof(struct inotify_event) + event->len;
+                if (!event->len) continue;
+                std::string name = event->name;
+                bool replaced = event->mask & IN_MOVED_TO;
+                auto it = std::find_if(changed.begin(), changed.end(),
+                    [&](const std::pair<std::string, bool>& c) { return c.first == name; });
+                if (it == changed.end()) {
+                    changed.emplace_back(name, replaced);
+                } else {
+                    it->second = it->second || replaced;
+                }
+            }
+        }
+        for (auto& c : changed) processFile(c.first, c.second);
+
+        std::vector<std::string> retry;
+        retry.swap(unresolved_follows);
+        for (auto& line : retry) {
+            if (!shipFollow(line)) unresolved_follows.push_back(line);
+        }
+        std::set<int> fresh;
+        {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            fresh.swap(new_clusters);
+        }
+        if (!fresh.empty()) {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            for (int c : fresh) {
+                for (auto& user : local_users) batchFor(c).add_users(user);
+            }
+        }
+        flush();
+        if (offsets_changed && deliveries.empty()) saveOffsets();
+    }
+}
+
+int main(int argc, char** argv) {
+    std::string port = "9001";
+    std::string host = "127.0.0.1";
+    std::string coordinator_ip = "127.0.0.1";
+    std::string coordinator_port = "3010";
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "c:d:p:a:h:k:")) != -1){
+        switch(opt) {
+            case 'c':
+                cluster_id = atoi(optarg);
+                break;
+            case 'd':
+                data_dir = optarg;
+                break;
+            case 'p':
+                port = optarg;
+                break;
+            case 'a':
+                host = optarg;
+                break;
+            case 'h':
+                coordinator_ip = optarg;
+                break;
+            case 'k':
+                coordinator_port = optarg;
+                break;
+            default:
+                std::cerr << "Invalid Command Line Argument\n";
+        }
+    }
+
+    std::string log_file_name = std::string("synchronizer-") + port;
+    google::InitGoogleLogging(log_file_name.c_str());
+    coordinator = CoordService::NewStub(grpc::CreateChannel(
+        coordinator_ip + ":" + coordinator_port, grpc::InsecureChannelCredentials()));
+    RunSynchronizer(port, host + ":" + port);
+    return 0;
+}
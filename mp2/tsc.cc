@@ -1,79 +1,115 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <sstream>
 #include <memory>
+#include <mutex>
 #include <thread>
 #include <vector>
 #include <string>
 #include <unistd.h>
+#include <fcntl.h>
 #include <csignal>
 #include <grpc++/grpc++.h>
 #include <glog/logging.h>
 #define log(severity, msg) LOG(severity) << msg; google::FlushLogFiles(google::severity);
 #include "client.h"
+#include "sns_client.h"
 
-#include "sns.grpc.pb.h" 
-#include "coordinator.grpc.pb.h"
-using grpc::Channel;
-using grpc::ClientContext;
-using grpc::ClientReader;
-using grpc::ClientReaderWriter;
-using grpc::ClientWriter;
-using grpc::Status;
 using csce438::Message;
-using csce438::ListReply;
-using csce438::Request;
-using csce438::Reply;
-using csce438::PingMsg;
-using csce438::SNSService;
-using csce438::CoordService;
 using csce438::ServerInfo;
-using csce438::Confirmation;
-using csce438::ID;
+
+//Directory of the timeline caches, -c
+std::string cache_dir = ".";
+
+//Posts the user has been shown, kept on disk so a restarted client can show
+//them right away and ask the server only for newer ones. Each entry is a
+//Message prefixed with its length as 4 little endian bytes; a torn entry at
+//the end is cut off on load.
+class TimelineCache {
+public:
+  static const size_t MAX_ENTRIES = 1000;
+
+  ~TimelineCache() {
+    if (fd >= 0) close(fd);
+  }
+
+  //Loads the newest MAX_ENTRIES cached posts, oldest first, and opens the
+  //cache for appending
+  std::vector<Message> open(const std::string& file) {
+    path = file;
+    std::vector<Message> entries;
+    std::ifstream in(path, std::ios::binary);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    std::string bytes = ss.str();
+    size_t good = 0;
+    while (good + 4 <= bytes.size()) {
+      uint32_t len = static_cast<uint8_t>(bytes[good]) | static_cast<uint8_t>(bytes[good + 1]) << 8 |
+                     static_cast<uint8_t>(bytes[good + 2]) << 16 | static_cast<uint32_t>(static_cast<uint8_t>(bytes[good + 3])) << 24;
+      Message m;
+      if (good + 4 + len > bytes.size() || !m.ParseFromArray(bytes.data() + good + 4, len)) break;
+      entries.push_back(m);
+      good += 4 + len;
+    }
+    //Rewrite the file when it has outgrown the bound or ends in a torn entry
+    if (entries.size() > MAX_ENTRIES || good < bytes.size()) {
+      if (entries.size() > MAX_ENTRIES)
+        entries.erase(entries.begin(), entries.end() - MAX_ENTRIES);
+      std::string tmp = path + ".tmp";
+      {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        for (auto& m : entries) out << frame(m);
+      }
+      std::rename(tmp.c_str(), path.c_str());
+    }
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    return entries;
+  }
+
+  void append(const Message& m) {
+    if (fd < 0) return;
+    std::string bytes = frame(m);
+    if (write(fd, bytes.data(), bytes.size()) != static_cast<ssize_t>(bytes.size()))
+      log(WARNING, "Could not write to timeline cache " + path);
+  }
+
+private:
+  static std::string frame(const Message& m) {
+    std::string body = m.SerializeAsString();
+    uint32_t len = body.size();
+    char header[4] = {static_cast<char>(len), static_cast<char>(len >> 8),
+                      static_cast<char>(len >> 16), static_cast<char>(len >> 24)};
+    return std::string(header, 4) + body;
+  }
+
+  std::string path;
+  int fd = -1;
+};
 
 void sig_ignore(int sig) {
   std::cout << "Signal caught " + sig;
 }
 
-Message MakeMessage(const std::string& username, const std::string& msg) {
-    Message m;
-    m.set_username(username);
-    m.set_msg(msg);
-    google::protobuf::Timestamp* timestamp = new google::protobuf::Timestamp();
-    timestamp->set_seconds(time(NULL));
-    timestamp->set_nanos(0);
-    m.set_allocated_timestamp(timestamp);
-    return m;
-}
-
-
 class Client : public IClient
 {
 public:
   Client(const std::string& hname,
 	 const std::string& uname,
 	 const std::string& p)
-    :coordinator_ip(hname), username(uname), coordinator_port(p) {}
+    :username(uname), sns(hname + ":" + p, uname) {}
 
-  
 protected:
   virtual int connectTo();
   virtual IReply processCommand(std::string& input);
   virtual void processTimeline();
 
 private:
-  std::string coordinator_ip;
-  std::string coordinator_port;
-  std::string hostname;
   std::string username;
-  std::string port;
-  
-  std::unique_ptr<CoordService::Stub> coordinator_stub_;
-  std::unique_ptr<SNSService::Stub> stub_;
-  
-  IReply Login();
-  IReply List();
-  IReply Follow(const std::string &username);
-  IReply UnFollow(const std::string &username);
-  void   Timeline(const std::string &username);
+  SNSClient sns;
 };
 
 
@@ -82,86 +118,23 @@ private:
 //////////////////////////////////////////////////////////
 int Client::connectTo()
 {
-  // ------------------------------------------------------------
-  // In this function, you are supposed to create a stub so that
-  // you call service methods in the processCommand/porcessTimeline
-  // functions. That is, the stub should be accessible when you want
-  // to call any service methods in those functions.
-  // I recommend you to have the stub as
-  // a member variable in your own Client class.
-  // Please refer to gRpc tutorial how to create a stub.
-  // ------------------------------------------------------------
-    std::string coordinator_info = coordinator_ip + ":" + coordinator_port;
-    coordinator_stub_ = std::unique_ptr<CoordService::Stub>(CoordService::NewStub(
-            grpc::CreateChannel(
-              coordinator_info, grpc::InsecureChannelCredentials())));
-    grpc::ClientContext context;
-    ID clientId;
-    ServerInfo targetServerInfo;
-    
-    clientId.set_id(std::stoi(username));
-    auto connectionStatus = coordinator_stub_->GetServer(&context, clientId, &targetServerInfo);
-    hostname = targetServerInfo.hostname();
-    port = targetServerInfo.port();
-    auto serverAddress = hostname + ":" + port;
-    log(INFO, "Connecting to server at " + serverAddress);
-    stub_ = std::make_unique<SNSService::Stub>(
-        grpc::CreateChannel(serverAddress, grpc::InsecureChannelCredentials())
-    );
-    auto loginResult = Login();
-    if (!loginResult.grpc_status.ok() || loginResult.comm_status == FAILURE_ALREADY_EXISTS) {
-        return -1;
-    }
-    return 1;
+  sns.onReconnect([](const ServerInfo& master) {
+    displayReConnectionMessage(master.hostname(), master.port());
+  });
+  return sns.connect();
 }
 
 IReply Client::processCommand(std::string& input)
 {
   // ------------------------------------------------------------
-  // GUIDE 1:
-  // In this function, you are supposed to parse the given input
-  // command and create your own message so that you call an 
-  // appropriate service method. The input command will be one
-  // of the followings:
+  // The input command is one of:
   //
   // FOLLOW <username>
   // UNFOLLOW <username>
   // LIST
   // TIMELINE
   //
-  // - JOIN/LEAVE and "<username>" are separated by one space.
-  // ------------------------------------------------------------
-  
-  // ------------------------------------------------------------
-  // GUIDE 2:
-  // Then, you should create a variable of IReply structure
-  // provided by the client.h and initialize it according to
-  // the result. Finally you can finish this function by returning
-  // the IReply.
-  // ------------------------------------------------------------
-  
-  
-  // ------------------------------------------------------------
-  // HINT: How to set the IReply?
-  // Suppose you have "Join" service method for JOIN command,
-  // IReply can be set as follow:
-  // 
-  //     // some codes for creating/initializing parameters for
-  //     // service method
-  //     IReply ire;
-  //     grpc::Status status = stub_->Join(&context, /* some parameters */);
-  //     ire.grpc_status = status;
-  //     if (status.ok()) {
-  //         ire.comm_status = SUCCESS;
-  //     } else {
-  //         ire.comm_status = FAILURE_NOT_EXISTS;
-  //     }
-  //      
-  //      return ire;
-  // 
-  // IMPORTANT: 
-  // For the command "LIST", you should set both "all_users" and 
-  // "following_users" member variable of IReply.
+  // - FOLLOW/UNFOLLOW and "<username>" are separated by one space.
   // ------------------------------------------------------------
 
   IReply ire;
@@ -169,23 +142,16 @@ IReply Client::processCommand(std::string& input)
   std::cout << "Processing "+input + ". ";
   if (index != std::string::npos) {
     std::string cmd = input.substr(0, index);
-    
-    /*
-      if (input.length() == index + 1) {
-      std::cout << "Invalid Input -- No Arguments Given\n";
-      }
-    */
-    
     std::string argument = input.substr(index+1, (input.length()-index));
     
     if (cmd == "FOLLOW") {
-      return Follow(argument);
+      return sns.follow(argument);
     } else if(cmd == "UNFOLLOW") {
-      return UnFollow(argument);
+      return sns.unfollow(argument);
     }
   } else {
     if (input == "LIST") {
-      return List();
+      return sns.list();
     } else if (input == "TIMELINE") {
       ire.comm_status = SUCCESS;
       return ire;
@@ -198,177 +164,132 @@ IReply Client::processCommand(std::string& input)
 
 void Client::processTimeline()
 {
-    Timeline(username);
-    // ------------------------------------------------------------
-    // In this function, you are supposed to get into timeline mode.
-    // You may need to call a service method to communicate with
-    // the server. Use getPostMessage/displayPostMessage functions
-    // for both getting and displaying messages in timeline mode.
-    // You should use them as you did in hw1.
-    // ------------------------------------------------------------
-
-    // ------------------------------------------------------------
-    // IMPORTANT NOTICE:
-    //
-    // Once a user enter to timeline mode , there is no way
-    // to command mode. You don't have to worry about this situation,
-    // and you can terminate the client program by pressing
-    // CTRL-C (SIGINT)
-    // ------------------------------------------------------------
+  // ------------------------------------------------------------
+  // Once a user enters timeline mode there is no way back to
+  // command mode; the client is terminated with CTRL-C (SIGINT)
+  // ------------------------------------------------------------
 
+  //Show what was cached last time, then only ask the server for newer posts
+  auto cache = std::make_shared<TimelineCache>();
+  uint64_t last_seq = 0;
+  for (const Message& m : cache->open(cache_dir + "/" + username + ".timeline.cache")) {
+    std::time_t time = m.timestamp().seconds();
+    displayPostMessage(m.username(), m.msg(), time);
+    last_seq = std::max<uint64_t>(last_seq, m.seq());
+  }
+  sns.subscribe([cache](const Message& m) {
+    std::time_t time = m.timestamp().seconds();
+    displayPostMessage(m.username(), m.msg(), time);
+    cache->append(m);
+  }, last_seq);
+
+  //Read chat messages and send them to the server
+  while (1) {
+    std::string msg = getPostMessage();
+    if (!sns.post(msg))
+      log(WARNING, "Post dropped while the Timeline stream reopens");
+  }
 }
 
-
-
-
 ///////////////////////////////////////////
-// List Command
+// Batch mode
 //////////////////////////////////////////
-IReply Client::List() {
-    //Data being sent to the server
-    Request request;
-    request.set_username(username);
-
-    //Container for the data from the server
-    ListReply list_reply;
 
-    //Context for the client
-    ClientContext context;
-
-    Status status = stub_->List(&context, request, &list_reply);
-    IReply ire;
-    ire.grpc_status = status;
-
-    //Loop through list_reply.all_users and list_reply.following_users
-    //Print out the name of each room
-    if(status.ok()){
-        ire.comm_status = SUCCESS;
-        std::string all_users;
-        std::string following_users;
-        for(std::string s : list_reply.all_users()){
-            ire.all_users.push_back(s);
-        }
-        for(std::string s : list_reply.followers()){
-            ire.followers.push_back(s);
-        }
-    }
-    return ire;
-}
-        
-IReply Client::Follow(const std::string& username2) {
-    Request request;
-    request.set_username(username);
-    request.add_arguments(username2);
-
-    Reply reply;
-    ClientContext context;
-
-    Status status = stub_->Follow(&context, request, &reply);
-    IReply ire; ire.grpc_status = status;
-    if (reply.msg() == "unkown user name") {
-        ire.comm_status = FAILURE_INVALID_USERNAME;
-    } else if (reply.msg() == "unknown follower username") {
-        ire.comm_status = FAILURE_INVALID_USERNAME;
-    } else if (reply.msg() == "you have already joined") {
-        ire.comm_status = FAILURE_ALREADY_EXISTS;
-    } else if (reply.msg() == "Follow Successful") {
-        ire.comm_status = SUCCESS;
-    } else {
-        ire.comm_status = FAILURE_UNKNOWN;
+//Runs a script of commands, one per line, at up to rate lines per second
+//(0 for no limit), printing failures and a summary. Besides the interactive
+//commands a script may use
+//
+// POST <message>     posts over the Timeline stream
+// WAIT <seconds>     pauses, e.g. to watch the timeline for a while
+//
+//TIMELINE subscribes and prints posts as they arrive. Blank lines and lines
+//starting with # are skipped.
+//
+//With a window above 0, FOLLOW and UNFOLLOW are pipelined, up to window of
+//them in flight, so a bulk import runs at about window/RTT commands per
+//second instead of 1/RTT. Any other command first waits for them to finish.
+int runScript(SNSClient& sns, const std::string& path, double rate, int window)
+{
+  std::ifstream script(path);
+  if (!script) {
+    std::cerr << "Cannot read " << path << std::endl;
+    return 1;
+  }
+  long commands = 0;
+  std::atomic<long> failed{0};
+  bool subscribed = false;
+  if (window > 0) sns.setWindow(window);
+  auto start = std::chrono::steady_clock::now();
+  auto next = start;
+  std::string line;
+  while (std::getline(script, line)) {
+    if (line.empty() || line[0] == '#') continue;
+    if (rate > 0) {
+      std::this_thread::sleep_until(next);
+      next += std::chrono::microseconds((long)(1e6 / rate));
     }
-    return ire;
-}
-
-IReply Client::UnFollow(const std::string& username2) {
-    Request request;
-
-    request.set_username(username);
-    request.add_arguments(username2);
-
-    Reply reply;
-
-    ClientContext context;
-
-    Status status = stub_->UnFollow(&context, request, &reply);
-    IReply ire;
-    ire.grpc_status = status;
-    if (reply.msg() == "Unknown follower") {
-        ire.comm_status = FAILURE_INVALID_USERNAME;
-    } else if (reply.msg() == "You are not a follower") {
-        ire.comm_status = FAILURE_NOT_A_FOLLOWER;
-    } else if (reply.msg() == "UnFollow Successful") {
-        ire.comm_status = SUCCESS;
-    } else {
-        ire.comm_status = FAILURE_UNKNOWN;
+    std::size_t index = line.find_first_of(" ");
+    std::string cmd = line.substr(0, index);
+    std::string argument = index == std::string::npos ? "" : line.substr(index + 1);
+    IReply reply;
+    reply.comm_status = SUCCESS;
+    if (window > 0 && (cmd == "FOLLOW" || cmd == "UNFOLLOW")) {
+      auto done = [line, &failed](const IReply& r) {
+        if (!r.grpc_status.ok() || r.comm_status != SUCCESS) {
+          failed++;
+          std::cout << "Failed: " << line << std::endl;
+        }
+      };
+      if (cmd == "FOLLOW") sns.followAsync(argument, done);
+      else sns.unfollowAsync(argument, done);
+      commands++;
+      continue;
     }
-
-    return ire;
-}
-
-IReply Client::Login() {
-    Request request;
-    request.set_username(username);
-    Reply reply;
-    ClientContext context;
-
-    Status status = stub_->Login(&context, request, &reply);
-
-    IReply ire;
-    ire.grpc_status = status;
-    std::cout << "REPLY MESSAGE: " + reply.msg();
-    if (reply.msg() == "you have already joined") {
-        ire.comm_status = FAILURE_ALREADY_EXISTS;
+    if (window > 0) sns.drain();
+    if (cmd == "FOLLOW") {
+      reply = sns.follow(argument);
+    } else if (cmd == "UNFOLLOW") {
+      reply = sns.unfollow(argument);
+    } else if (cmd == "LIST") {
+      reply = sns.list();
+    } else if (cmd == "TIMELINE") {
+      if (!subscribed) {
+        sns.subscribe([](const Message& m) {
+          std::time_t time = m.timestamp().seconds();
+          displayPostMessage(m.username(), m.msg(), time);
+        });
+        subscribed = true;
+      }
+    } else if (cmd == "POST") {
+      if (!subscribed || !sns.post(argument + "\n"))
+        reply.comm_status = FAILURE_INVALID;
+    } else if (cmd == "WAIT") {
+      std::this_thread::sleep_for(std::chrono::milliseconds((long)(atof(argument.c_str()) * 1000)));
     } else {
-        ire.comm_status = SUCCESS;
+      reply.comm_status = FAILURE_INVALID;
     }
-    return ire;
-}
-
-void Client::Timeline(const std::string& username) {
-  ClientContext context;
-
-  std::shared_ptr<ClientReaderWriter<Message, Message>> stream(
-				  stub_->Timeline(&context));
-
-  //Thread used to read chat messages and send them to the server
-  std::thread writer([username, stream]() {
-    std::string input = "Set Stream";
-    Message m = MakeMessage(username, input);
-    stream->Write(m);
-    while (1) {
-      input = getPostMessage();
-      m = MakeMessage(username, input);
-      stream->Write(m);
+    commands++;
+    if (!reply.grpc_status.ok() || reply.comm_status != SUCCESS) {
+      failed++;
+      std::cout << "Failed: " << line << std::endl;
     }
-    stream->WritesDone();
-  });
-  
-  std::thread reader([username, stream]() {
-    Message m;
-    while(stream->Read(&m)){
-      google::protobuf::Timestamp temptime = m.timestamp();
-      std::time_t time = temptime.seconds();
-      displayPostMessage(m.username(), m.msg(), time);
-    }
-  });
-  
-  //Wait for the threads to finish
-  writer.join();
-  reader.join();
+  }
+  sns.drain();
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cout << commands << " commands in " << elapsed << " s (" << (elapsed > 0 ? commands / elapsed : 0)
+            << "/s, window " << window << "), " << failed << " failed" << std::endl;
+  return failed ? 1 : 0;
 }
 
-
-
-//////////////////////////////////////////////
-// Main Function
-/////////////////////////////////////////////
-
 int main(int argc, char** argv) {
   std::string coordinator_ip = "localhost";
   std::string username = "default";
   std::string coordinator_port = "3010";
+  std::string script;
+  double rate = 0;
+  int window = 0;
   int opt = 0;
-  while ((opt = getopt(argc, argv, "h:k:u:")) != -1){
+  while ((opt = getopt(argc, argv, "h:k:u:c:f:r:w:")) != -1){
     switch(opt) {
     case 'h':
       coordinator_ip = optarg;break;
@@ -376,6 +297,14 @@ int main(int argc, char** argv) {
       coordinator_port = optarg;break;
     case 'u':
       username = optarg;break;
+    case 'c':
+      cache_dir = optarg;break;
+    case 'f':
+      script = optarg;break;
+    case 'r':
+      rate = atof(optarg);break;
+    case 'w':
+      window = atoi(optarg);break;
     default:
       std::cout << "Invalid Command Line Argument\n";
     }
@@ -383,6 +312,17 @@ int main(int argc, char** argv) {
 
   std::string log_file_name = std::string("client-") + username;
   google::InitGoogleLogging(log_file_name.c_str());    
+
+  //Batch mode: no prompt, commands come from the script
+  if (!script.empty()) {
+    SNSClient sns(coordinator_ip + ":" + coordinator_port, username);
+    if (sns.connect() < 0) {
+      std::cerr << "connection failed" << std::endl;
+      return 1;
+    }
+    return runScript(sns, script, rate, window);
+  }
+
   std::cout << "Logging Initialized. Client starting...";
   Client myc(coordinator_ip, username, coordinator_port);
   
@@ -0,0 +1,339 @@
+// Multiplexing client: hosts many users in one process, for gateways, bots
+// and load tests.
+//
+// Users share a small pool of channels to each server, and every RPC runs
+// asynchronously on a few completion queue loops instead of the reader and
+// writer threads tsc uses per user. Each user logs in, opens a Timeline
+// stream and optionally posts at a fixed rate.
+//
+//   ./tsc_mux -h 127.0.0.1 -k 3010 -u 1000 -n 5000 -c 4 -t 2 -p 0.1 -d 60
+//
+// -u first user id, -n users (ids u .. u+n-1), -c channels per server,
+// -t event loop threads, -p posts per second per user, -d seconds to run
+// (0 runs until killed). Every 10 s it reports open sessions, posts
+// received and sent, and resident memory per session.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+#include <grpc++/grpc++.h>
+#include <google/protobuf/util/time_util.h>
+
+#include "coordinator.grpc.pb.h"
+#include "sns_v2.grpc.pb.h"
+
+using grpc::ClientAsyncReaderWriter;
+using grpc::ClientAsyncResponseReader;
+using grpc::ClientContext;
+using grpc::CompletionQueue;
+using grpc::Status;
+using csce438::CoordService;
+using csce438::ID;
+using csce438::Request;
+using csce438::ServerInfo;
+namespace v2 = csce438::v2;
+
+struct Session;
+
+// completion queue tag: which operation of which session finished
+struct Op {
+    enum Kind { LOGIN, START, WRITE, READ, FINISH };
+    Session* session;
+    Kind kind;
+};
+
+struct Session {
+    std::string username;
+    std::shared_ptr<v2::SNSService::Stub> stub;
+
+    ClientContext loginContext;
+    std::unique_ptr<ClientAsyncResponseReader<v2::Reply>> login;
+    v2::Reply loginReply;
+    Status loginStatus;
+
+    std::unique_ptr<ClientContext> streamContext;
+    std::unique_ptr<ClientAsyncReaderWriter<v2::TimelineRequest, v2::TimelineEvent>> stream;
+    v2::TimelineRequest request;
+    v2::TimelineEvent event;
+    Status finishStatus;
+    bool open = false;
+    // one Write may be outstanding per stream; posts due meanwhile wait here
+    bool writing = false;
+    int queuedPosts = 0;
+
+    Op loginOp{this, Op::LOGIN};
+    Op startOp{this, Op::START};
+    Op writeOp{this, Op::WRITE};
+    Op readOp{this, Op::READ};
+    Op finishOp{this, Op::FINISH};
+};
+
+std::atomic<long> sessions_open{0};
+std::atomic<long> logins_failed{0};
+std::atomic<long> posts_received{0};
+std::atomic<long> posts_sent{0};
+std::atomic<bool> stopping{false};
+
+long resident_bytes() {
+    std::ifstream statm("/proc/self/statm");
+    long pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// runs the sessions assigned to one completion queue. every operation on
+// them happens on this thread, so sessions need no locks
+class EventLoop {
+public:
+    EventLoop(std::vector<Session*> sessions, double postRate)
+        : sessions(std::move(sessions)), postRate(postRate) {}
+
+    void run() {
+        for (Session* s : sessions) startLogin(s);
+        auto last = std::chrono::steady_clock::now();
+        double postsDue = 0;
+        size_t nextPoster = 0;
+        bool cancelled = false;
+        while (true) {
+            void* tag;
+            bool ok;
+            auto deadline = std::chrono::system_clock::now() + std::chrono::milliseconds(100);
+            CompletionQueue::NextStatus status = cq.AsyncNext(&tag, &ok, deadline);
+            if (status == CompletionQueue::SHUTDOWN) return;
+            if (status == CompletionQueue::GOT_EVENT) {
+                outstanding--;
+                handle(static_cast<Op*>(tag), ok);
+            }
+
+            if (stopping) {
+                if (!cancelled) {
+                    for (Session* s : sessions) {
+                        s->loginContext.TryCancel();
+                        if (s->streamContext) s->streamContext->TryCancel();
+                    }
+                    cancelled = true;
+                }
+                if (outstanding == 0) cq.Shutdown();
+                continue;
+            }
+
+            // spread the posts due since the last pass over the sessions in turn
+            auto now = std::chrono::steady_clock::now();
+            postsDue += postRate * sessions.size() * std::chrono::duration<double>(now - last).count();
+            last = now;
+            for (size_t tries = 0; postsDue >= 1 && tries < sessions.size(); tries++) {
+                Session* s = sessions[nextPoster++ % sessions.size()];
+                if (!s->open) continue;
+                s->queuedPosts++;
+                postsDue -= 1;
+                if (!s->writing) writeNext(s);
+            }
+            // sessions that aren't open don't carry their share over
+            postsDue = std::min(postsDue, 1.0 * sessions.size());
+        }
+    }
+
+private:
+    void startLogin(Session* s) {
+        Request request;
+        request.set_username(s->username);
+        s->login = s->stub->PrepareAsyncLogin(&s->loginContext, request, &cq);
+        s->login->StartCall();
+        s->login->Finish(&s->loginReply, &s->loginStatus, &s->loginOp);
+        outstanding++;
+    }
+
+    void writeNext(Session* s) {
+        v2::Post* post = s->request.mutable_post();
+        post->set_msg("post from " + s->username + "\n");
+        *post->mutable_timestamp() = google::protobuf::util::TimeUtil::GetCurrentTime();
+        s->queuedPosts--;
+        s->writing = true;
+        s->stream->Write(s->request, &s->writeOp);
+        outstanding++;
+        posts_sent++;
+    }
+
+    void read(Session* s) {
+        s->stream->Read(&s->event, &s->readOp);
+        outstanding++;
+    }
+
+    void handle(Op* op, bool ok) {
+        Session* s = op->session;
+        switch (op->kind) {
+        case Op::LOGIN:
+            if (!ok || !s->loginStatus.ok() || s->loginReply.status() != v2::STATUS_OK || stopping) {
+                logins_failed++;
+                return;
+            }
+            s->streamContext.reset(new ClientContext());
+            s->stream = s->stub->PrepareAsyncTimeline(s->streamContext.get(), &cq);
+            s->stream->StartCall(&s->startOp);
+            outstanding++;
+            break;
+        case Op::START:
+            if (!ok) {
+                finish(s);
+                return;
+            }
+            s->open = true;
+            sessions_open++;
+            s->request.mutable_set_stream()->set_username(s->username);
+            s->writing = true;
+            s->stream->Write(s->request, &s->writeOp);
+            outstanding++;
+            read(s);
+            break;
+        case Op::WRITE:
+            s->writing = false;
+            if (ok && s->open && s->queuedPosts > 0) writeNext(s);
+            break;
+        case Op::READ:
+            if (!ok) {
+                finish(s);
+                return;
+            }
+            posts_received += s->event.kind_case() == v2::TimelineEvent::kBatch
+                ? s->event.batch().messages_size() : 1;
+            read(s);
+            break;
+        case Op::FINISH:
+            if (!stopping) {
+                std::cerr << "Timeline of " << s->username << " ended: " << s->finishStatus.error_message() << std::endl;
+            }
+            break;
+        }
+    }
+
+    void finish(Session* s) {
+        if (s->open) {
+            s->open = false;
+            sessions_open--;
+        }
+        s->stream->Finish(&s->finishStatus, &s->finishOp);
+        outstanding++;
+    }
+
+    std::vector<Session*> sessions;
+    double postRate;
+    CompletionQueue cq;
+    // operations started and not yet returned by the queue
+    long outstanding = 0;
+};
+
+int main(int argc, char** argv) {
+    std::string coordinator_ip = "127.0.0.1";
+    std::string coordinator_port = "3010";
+    int first_user = 1000;
+    int num_users = 1000;
+    int channels_per_server = 4;
+    int num_threads = 2;
+    double post_rate = 0;
+    int duration_secs = 0;
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "h:k:u:n:c:t:p:d:")) != -1){
+        switch(opt) {
+            case 'h':
+                coordinator_ip = optarg;
+                break;
+            case 'k':
+                coordinator_port = optarg;
+                break;
+            case 'u':
+                first_user = atoi(optarg);
+                break;
+            case 'n':
+                num_users = atoi(optarg);
+                break;
+            case 'c':
+                channels_per_server = std::max(1, atoi(optarg));
+                break;
+            case 't':
+                num_threads = std::max(1, atoi(optarg));
+                break;
+            case 'p':
+                post_rate = atof(optarg);
+                break;
+            case 'd':
+                duration_secs = atoi(optarg);
+                break;
+            default:
+                std::cerr << "Invalid Command Line Argument\n";
+        }
+    }
+
+    long base_rss = resident_bytes();
+    std::unique_ptr<CoordService::Stub> coordinator = CoordService::NewStub(grpc::CreateChannel(
+        coordinator_ip + ":" + coordinator_port, grpc::InsecureChannelCredentials()));
+
+    // a few channels per server; the local subchannel pool gives each its own connection
+    grpc::ChannelArguments args;
+    args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+    std::map<std::string, std::vector<std::shared_ptr<v2::SNSService::Stub>>> pools;
+
+    std::vector<std::unique_ptr<Session>> sessions;
+    for (int i = 0; i < num_users; i++) {
+        ID id;
+        id.set_id(first_user + i);
+        ServerInfo server;
+        ClientContext context;
+        Status status = coordinator->GetServer(&context, id, &server);
+        if (!status.ok()) {
+            std::cerr << "No server for user " << first_user + i << ": " << status.error_message() << std::endl;
+            continue;
+        }
+        std::string address = server.hostname() + ":" + server.port();
+        auto& pool = pools[address];
+        if (pool.empty()) {
+            for (int c = 0; c < channels_per_server; c++) {
+                pool.push_back(v2::SNSService::NewStub(
+                    grpc::CreateCustomChannel(address, grpc::InsecureChannelCredentials(), args)));
+            }
+        }
+        std::unique_ptr<Session> s(new Session());
+        s->username = std::to_string(first_user + i);
+        s->stub = pool[sessions.size() % pool.size()];
+        sessions.push_back(std::move(s));
+    }
+    std::cout << sessions.size() << " users on " << pools.size() << " servers, "
+              << channels_per_server << " channels each" << std::endl;
+
+    std::vector<std::unique_ptr<EventLoop>> loops;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+        std::vector<Session*> mine;
+        for (size_t i = t; i < sessions.size(); i += num_threads) mine.push_back(sessions[i].get());
+        loops.emplace_back(new EventLoop(mine, post_rate));
+        threads.emplace_back(&EventLoop::run, loops.back().get());
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    long last_received = 0, last_sent = 0;
+    const int interval = 10;
+    while (duration_secs == 0 || std::chrono::steady_clock::now() - start < std::chrono::seconds(duration_secs)) {
+        sleep(std::min(interval, duration_secs == 0 ? interval : duration_secs));
+        long open = sessions_open, received = posts_received, sent = posts_sent;
+        long rss = resident_bytes();
+        std::cout << open << " sessions open (" << logins_failed << " logins failed), "
+                  << (received - last_received) / interval << " posts/s received, "
+                  << (sent - last_sent) / interval << " posts/s sent, RSS " << rss / (1024 * 1024) << " MB, "
+                  << (open ? (rss - base_rss) / open / 1024 : 0) << " KB per session" << std::endl;
+        last_received = received;
+        last_sent = sent;
+    }
+
+    stopping = true;
+    for (auto& t : threads) t.join();
+    return 0;
+}
@@ -31,16 +31,32 @@
  *
  */
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
 #include <ctime>
+#include <deque>
 
 #include <google/protobuf/timestamp.pb.h>
 #include <google/protobuf/duration.pb.h>
 
 #include <fstream>
 #include <iostream>
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
 #include <string>
+#include <map>
+#include <set>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
 #include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <thread>
 #include <google/protobuf/util/time_util.h>
@@ -49,7 +65,9 @@
 #define log(severity, msg) LOG(severity) << msg; google::FlushLogFiles(google::severity); 
 
 #include "sns.grpc.pb.h"
+#include "sns_v2.grpc.pb.h"
 #include "coordinator.grpc.pb.h"
+#include "peer.grpc.pb.h"
 
 
 using google::protobuf::Timestamp;
@@ -70,51 +88,1119 @@ using csce438::SNSService;
 using csce438::CoordService;
 using csce438::ServerInfo;
 using csce438::Confirmation;
+using csce438::CoordCommand;
+namespace v2 = csce438::v2;
+namespace peer = csce438::peer;
+using v2::StatusCode;
+
+//Dense integer id assigned to each username at Login
+typedef uint32_t UserId;
 
 struct Client {
+  UserId id;
   std::string username;
+  //Timeline file names, built once at Login rather than per message
+  std::string timeline_file;
+  std::string following_file;
   bool connected = true;
+  //Homed on another cluster, known here so local users can follow them
+  bool remote = false;
   int following_file_size = 0;
-  std::vector<Client*> client_followers;
-  std::vector<Client*> client_following;
-  ServerReaderWriter<Message, Message>* stream = 0;
+  //Guards client_followers and client_following
+  std::mutex graph_mutex;
+  std::vector<UserId> client_followers;
+  std::vector<UserId> client_following;
+  //Set while the user has a Timeline stream open, guarded by stream_mutex
+  class TimelineSink* stream = 0;
+  std::mutex stream_mutex;
+  //Sequence number of the next post in following_file and the newest posts
+  //delivered, for streams that resume. Guarded by stream_mutex
+  uint64_t next_seq = 1;
+  std::deque<Message> recent;
+  //Posts not yet written to a stream: those that arrived while the user was
+  //offline, then the backlog being sent on reconnect. Always the newest posts,
+  //up to offline.max_posts. Guarded by stream_mutex
+  std::deque<Message> inbox;
+  //Set while a reconnected stream works through the inbox; new posts queue
+  //behind it instead of going straight to the stream
+  bool catching_up = false;
+  //Sequence number of the first record still in following_file, moved on by
+  //compaction with the file's lock held
+  std::atomic<uint64_t> following_base{1};
   bool operator==(const Client& c1) const{
-    return (username == c1.username);
+    return (id == c1.id);
+  }
+};
+
+//Table that stores every client that has been created, indexed by UserId.
+//Entries never move once added, so lookups by id need no lock.
+class ClientTable {
+public:
+  Client* operator[](UserId id) const {
+    return chunks[id / CHUNK_SIZE].load(std::memory_order_acquire)[id % CHUNK_SIZE];
+  }
+  size_t size() const {
+    return count.load(std::memory_order_acquire);
+  }
+  //Must be called with db_mutex held
+  UserId add(Client* c){
+    size_t id = count.load(std::memory_order_relaxed);
+    if(id / CHUNK_SIZE >= MAX_CHUNKS){
+      log(ERROR, "Client table is full");
+      abort();
+    }
+    if(id % CHUNK_SIZE == 0)
+      chunks[id / CHUNK_SIZE].store(new Client*[CHUNK_SIZE], std::memory_order_release);
+    chunks[id / CHUNK_SIZE].load(std::memory_order_relaxed)[id % CHUNK_SIZE] = c;
+    count.store(id + 1, std::memory_order_release);
+    return id;
   }
+private:
+  static const size_t CHUNK_SIZE = 1024;
+  static const size_t MAX_CHUNKS = 16384;
+  std::atomic<Client**> chunks[MAX_CHUNKS] = {};
+  std::atomic<size_t> count{0};
+};
+ClientTable client_db;
+//Interns usernames to their UserId; names are only used at the RPC boundary
+std::unordered_map<std::string, UserId> user_ids;
+//Guards user_ids and additions to client_db
+std::mutex db_mutex;
+
+//Retention policy enforced by the background compaction thread.
+//A limit of 0 disables it; with both limits at 0 no compaction runs.
+struct RetentionPolicy {
+  int max_posts = 0;
+  int max_days = 0;
+  int interval_secs = 60;
 };
+RetentionPolicy retention;
 
-//Vector that stores every client that has been created
-std::vector<Client*> client_db;
+//Compaction metrics, reported after every pass
+long compaction_bytes_reclaimed = 0;
+long compaction_passes = 0;
+
+//Coalescing of posts into MessageBatch frames on v2 Timeline streams.
+//A frame goes out once max_batch posts are queued or the oldest has waited linger_ms.
+struct BatchingPolicy {
+  int linger_ms = 5;
+  int max_batch = 64;
+};
+BatchingPolicy batching;
+
+//Bound on each user's offline inbox, and how fast a reconnected stream is
+//sent its backlog: catchup_batch posts every catchup_interval_ms
+struct OfflinePolicy {
+  int max_posts = 1000;
+  int catchup_batch = 64;
+  int catchup_interval_ms = 10;
+};
+OfflinePolicy offline;
+//Posts sent from inboxes and posts dropped from full ones, reported by the stats thread
+std::atomic<long> catchup_posts{0};
+std::atomic<long> inbox_dropped{0};
+
+//Timeline stream metrics, reported by the stats thread
+std::atomic<long> frames_written{0};
+std::atomic<long> messages_written{0};
+//Time spent fanning posts out to local followers, and the deliveries made
+std::atomic<long> fanout_time_us{0};
+std::atomic<long> fanout_deliveries{0};
+
+//One lock per timeline file so appends and compaction never interleave
+std::mutex file_locks_mutex;
+std::unordered_map<std::string, std::unique_ptr<std::mutex>> file_locks;
 
 // Stub for coordinator
 std::unique_ptr<CoordService::Stub> stub_;
+//Every coordinator of a replicated group (-k 3010,3020,3030); only the
+//leader takes heartbeats, so the stub follows it
+std::vector<std::string> coordinators;
+size_t current_coordinator = 0;
+
+//Call metadata key a client uses to bind its Timeline stream to a user up front,
+//after which its posts may leave Message::username empty
+const std::string SESSION_USER_KEY = "sns-session-user";
+
+//Helper function used to find a user's id given their username, -1 if unknown
+int find_user(const std::string& username){
+  std::lock_guard<std::mutex> guard(db_mutex);
+  auto it = user_ids.find(username);
+  if(it == user_ids.end())
+    return -1;
+  return it->second;
+}
+
+//Returns the lock that serializes access to the given timeline file
+std::mutex& file_lock(const std::string& filename){
+  std::lock_guard<std::mutex> guard(file_locks_mutex);
+  std::unique_ptr<std::mutex>& m = file_locks[filename];
+  if(!m)
+    m.reset(new std::mutex());
+  return *m;
+}
+
+//Appends a record to a timeline file; each record is written whole under the file lock
+void append_to_file(const std::string& filename, const std::string& record){
+  std::lock_guard<std::mutex> guard(file_lock(filename));
+  std::ofstream file(filename,std::ios::app|std::ios::out|std::ios::in);
+  file << record;
+}
+
+long file_size(const std::string& filename){
+  struct stat st;
+  if(stat(filename.c_str(), &st) != 0)
+    return -1;
+  return st.st_size;
+}
+
+//Rewrites a timeline file keeping only the posts allowed by the retention policy.
+//The snapshot is filtered without holding the file lock; the lock is only taken
+//to carry over records appended in the meantime and to rename the result into place.
+//Returns the number of bytes reclaimed. If base is given it is advanced past
+//the dropped records and saved next to the file.
+long compact_file(const std::string& filename, std::atomic<uint64_t>* base = nullptr){
+  long snapshot_size;
+  {
+    std::lock_guard<std::mutex> guard(file_lock(filename));
+    snapshot_size = file_size(filename);
+  }
+  if(snapshot_size <= 0)
+    return 0;
+
+  std::string data(snapshot_size, '\0');
+  std::ifstream in(filename, std::ios::binary);
+  in.read(&data[0], snapshot_size);
+  if(in.gcount() != snapshot_size)
+    return 0;
+  in.close();
+
+  //A record is a "<time> :: <user>:<msg>" line plus the blank lines that follow it
+  std::vector<std::pair<size_t, size_t>> records;
+  size_t pos = 0;
+  while(pos < data.size()){
+    size_t start = pos;
+    pos = data.find('\n', pos);
+    pos = (pos == std::string::npos) ? data.size() : pos + 1;
+    while(pos < data.size() && data[pos] == '\n')
+      pos++;
+    records.push_back(std::make_pair(start, pos - start));
+  }
+
+  size_t first_kept = 0;
+  if(retention.max_days > 0){
+    int64_t cutoff = time(NULL) - (int64_t)retention.max_days * 24 * 60 * 60;
+    while(first_kept < records.size()){
+      std::string header = data.substr(records[first_kept].first, records[first_kept].second);
+      Timestamp ts;
+      size_t sep = header.find(" :: ");
+      //Records without a readable timestamp are kept rather than guessed at
+      if(sep == std::string::npos
+         || !google::protobuf::util::TimeUtil::FromString(header.substr(0, sep), &ts)
+         || ts.seconds() >= cutoff)
+        break;
+      first_kept++;
+    }
+  }
+  if(retention.max_posts > 0 && records.size() - first_kept > (size_t)retention.max_posts)
+    first_kept = records.size() - retention.max_posts;
+  if(first_kept == 0)
+    return 0;
+
+  std::string tmp_name = filename + ".compact";
+  std::ofstream out(tmp_name, std::ios::binary|std::ios::trunc);
+  if(first_kept < records.size())
+    out.write(data.data() + records[first_kept].first, snapshot_size - records[first_kept].first);
+
+  std::lock_guard<std::mutex> guard(file_lock(filename));
+  long current_size = file_size(filename);
+  if(current_size > snapshot_size){
+    std::ifstream tail(filename, std::ios::binary);
+    tail.seekg(snapshot_size);
+    out << tail.rdbuf();
+  }
+  out.close();
+  //<file>.trimmed counts the bytes cut from the front of the file so far,
+  //for the synchronizer to find its place in the new file. Written before
+  //the rename, so it is there by the time the new file appears
+  std::string trimmed_name = filename + ".trimmed";
+  long trimmed = 0;
+  std::ifstream(trimmed_name) >> trimmed;
+  long cut = first_kept < records.size() ? records[first_kept].first : snapshot_size;
+  if(out)
+    std::ofstream(trimmed_name, std::ios::trunc) << trimmed + cut << "\n";
+  if(!out || std::rename(tmp_name.c_str(), filename.c_str()) != 0){
+    log(ERROR, "Compaction of " + filename + " failed");
+    std::remove(tmp_name.c_str());
+    if(out)
+      std::ofstream(trimmed_name, std::ios::trunc) << trimmed << "\n";
+    return 0;
+  }
+  if(base){
+    *base += first_kept;
+    std::ofstream(filename + ".base", std::ios::trunc) << *base << "\n";
+  }
+  return current_size - file_size(filename);
+}
+
+//Background thread that periodically applies the retention policy to every timeline file
+void CompactTimelines(){
+  while(true){
+    sleep(retention.interval_secs);
+    auto start = std::chrono::steady_clock::now();
+
+    size_t user_count = client_db.size();
+    long reclaimed = 0;
+    for(UserId id = 0; id < user_count; id++){
+      reclaimed += compact_file(client_db[id]->timeline_file);
+      reclaimed += compact_file(client_db[id]->following_file, &client_db[id]->following_base);
+    }
+
+    long elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    compaction_passes++;
+    compaction_bytes_reclaimed += reclaimed;
+    log(INFO, "Compaction pass " + std::to_string(compaction_passes) + " reclaimed "
+        + std::to_string(reclaimed) + " bytes from " + std::to_string(user_count)
+        + " users in " + std::to_string(elapsed_ms) + " ms (total reclaimed "
+        + std::to_string(compaction_bytes_reclaimed) + " bytes)");
+  }
+}
+
+//Splits timeline file contents into records, as compaction does
+std::vector<std::string> split_records(const std::string& data){
+  std::vector<std::string> records;
+  size_t pos = 0;
+  while(pos < data.size()){
+    size_t start = pos;
+    pos = data.find('\n', pos);
+    pos = (pos == std::string::npos) ? data.size() : pos + 1;
+    while(pos < data.size() && data[pos] == '\n')
+      pos++;
+    records.push_back(data.substr(start, pos - start));
+  }
+  return records;
+}
+
+std::string read_file(const std::string& filename){
+  std::ifstream in(filename, std::ios::binary);
+  std::stringstream data;
+  data << in.rdbuf();
+  return data.str();
+}
+
+std::vector<std::string> read_records(const std::string& filename){
+  return split_records(read_file(filename));
+}
+
+//The line a post is stored as in timeline files
+std::string timeline_record(const Message& message){
+  std::string time = google::protobuf::util::TimeUtil::ToString(message.timestamp());
+  return time+" :: "+message.username()+":"+message.msg()+"\n";
+}
+
+//The post a timeline record was written for, the inverse of timeline_record
+bool parse_record(const std::string& record, Message* message){
+  size_t sep = record.find(" :: ");
+  size_t colon = sep == std::string::npos ? sep : record.find(':', sep + 4);
+  if(colon == std::string::npos
+     || !google::protobuf::util::TimeUtil::FromString(record.substr(0, sep), message->mutable_timestamp()))
+    return false;
+  message->set_username(record.substr(sep + 4, colon - sep - 4));
+  message->set_msg(record.substr(colon + 1, record.size() - colon - 2));
+  return true;
+}
+
+//Where a follower's timeline posts are written, one implementation per protocol version.
+//Write only queues the post, so fan-out can call it with stream_mutex held
+//without waiting on a slow reader
+class TimelineSink {
+public:
+  virtual ~TimelineSink() {}
+  virtual bool Write(const Message& message) = 0;
+};
+
+//Queues posts for a dedicated writer thread, which sends each as its own message
+class TimelineSinkV1 : public TimelineSink {
+public:
+  explicit TimelineSinkV1(ServerReaderWriter<Message, Message>* s)
+    : stream(s), writer(&TimelineSinkV1::WriteLoop, this) {}
+  ~TimelineSinkV1(){
+    {
+      std::lock_guard<std::mutex> guard(mu);
+      stopped = true;
+    }
+    cv.notify_one();
+    writer.join();
+  }
+  bool Write(const Message& message) override {
+    {
+      std::lock_guard<std::mutex> guard(mu);
+      if(stopped)
+        return false;
+      pending.push_back(message);
+    }
+    cv.notify_one();
+    return true;
+  }
+private:
+  void WriteLoop(){
+    std::vector<Message> sending;
+    std::unique_lock<std::mutex> lock(mu);
+    while(true){
+      cv.wait(lock, [this]{ return stopped || !pending.empty(); });
+      if(pending.empty())
+        return;
+      sending.swap(pending);
+      lock.unlock();
+
+      bool ok = true;
+      for(size_t i = 0; ok && i < sending.size(); i++)
+        ok = stream->Write(sending[i]);
+      sending.clear();
+
+      lock.lock();
+      if(!ok)
+        stopped = true;
+    }
+  }
+
+  ServerReaderWriter<Message, Message>* stream;
+  std::mutex mu;
+  std::condition_variable cv;
+  std::vector<Message> pending;
+  bool stopped = false;
+  std::thread writer;
+};
+
+//Queues posts and lets a dedicated writer thread send them as MessageBatch frames.
+//The writer thread is also the only thread that writes to the stream.
+class TimelineSinkV2 : public TimelineSink {
+public:
+  explicit TimelineSinkV2(ServerReaderWriter<v2::TimelineEvent, v2::TimelineRequest>* s)
+    : stream(s), writer(&TimelineSinkV2::WriteLoop, this) {}
+  ~TimelineSinkV2(){
+    {
+      std::lock_guard<std::mutex> guard(mu);
+      stopped = true;
+    }
+    cv.notify_one();
+    writer.join();
+  }
+  bool Write(const Message& message) override {
+    {
+      std::lock_guard<std::mutex> guard(mu);
+      if(stopped)
+        return false;
+      if(pending.empty())
+        oldest = std::chrono::steady_clock::now();
+      pending.push_back(message);
+    }
+    cv.notify_one();
+    return true;
+  }
+private:
+  void WriteLoop(){
+    std::vector<Message> frame;
+    v2::TimelineEvent event;
+    std::unique_lock<std::mutex> lock(mu);
+    while(true){
+      cv.wait(lock, [this]{ return stopped || !pending.empty(); });
+      if(pending.empty())
+        return;
+      //Linger so that a burst of posts shares one frame
+      auto deadline = oldest + std::chrono::milliseconds(batching.linger_ms);
+      cv.wait_until(lock, deadline, [this]{ return stopped || pending.size() >= (size_t)batching.max_batch; });
+
+      size_t n = std::min(pending.size(), (size_t)batching.max_batch);
+      frame.assign(std::make_move_iterator(pending.begin()), std::make_move_iterator(pending.begin() + n));
+      pending.erase(pending.begin(), pending.begin() + n);
+      if(!pending.empty())
+        oldest = std::chrono::steady_clock::now();
+      lock.unlock();
+
+      if(frame.size() == 1){
+        *event.mutable_post() = std::move(frame[0]);
+      }else{
+        v2::MessageBatch* batch = event.mutable_batch();
+        batch->clear_messages();
+        for(Message& m : frame)
+          *batch->add_messages() = std::move(m);
+      }
+      bool ok = stream->Write(event);
+      frames_written++;
+      messages_written += frame.size();
+
+      lock.lock();
+      if(!ok)
+        stopped = true;
+    }
+  }
+
+  ServerReaderWriter<v2::TimelineEvent, v2::TimelineRequest>* stream;
+  std::mutex mu;
+  std::condition_variable cv;
+  std::vector<Message> pending;
+  std::chrono::steady_clock::time_point oldest;
+  bool stopped = false;
+  std::thread writer;
+};
+
+//This server's role and its cluster's membership, as last pushed by the coordinator
+std::atomic<bool> is_master{false};
+std::mutex membership_mutex;
+ServerInfo cluster_master;
+std::vector<ServerInfo> cluster_members;
+
+//Replication of the master's changes to the slaves of its cluster
+
+//Mutations made as master, kept for the slaves to catch up on. Sequence
+//numbers carry on from the last one applied as a slave, so a promoted
+//slave continues its old master's numbering. Nothing here survives a
+//restart, so every process starts a log of its own under a random epoch,
+//and a slave takes over its master's epoch with a snapshot
+class ReplicationLog {
+public:
+  explicit ReplicationLog(size_t capacity) : capacity(capacity) {
+    std::random_device random;
+    while(log_epoch == 0)
+      log_epoch = (uint64_t(random()) << 32) | random();
+  }
+
+  void append(peer::Mutation& m){
+    auto now = std::chrono::steady_clock::now();
+    {
+      std::lock_guard<std::mutex> guard(mu);
+      m.set_seq(++last_seq);
+      entries.push_back(Entry{m, now});
+      if(entries.size() > capacity)
+        entries.pop_front();
+    }
+    cv.notify_all();
+    replication_appends++;
+    replication_append_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - now).count();
+  }
+
+  //Copies up to max mutations, and about max_bytes, after seq `after`, waiting
+  //up to `wait` for one to arrive. Sets *gap if some were already dropped from the buffer
+  bool read(uint64_t after, size_t max, size_t max_bytes, peer::MutationBatch* batch, bool* gap, std::chrono::milliseconds wait){
+    std::unique_lock<std::mutex> guard(mu);
+    if(!cv.wait_for(guard, wait, [&]() { return last_seq > after && !entries.empty(); }))
+      return false;
+    uint64_t first = entries.front().m.seq();
+    *gap = after + 1 < first;
+    size_t start = *gap ? 0 : after + 1 - first;
+    size_t bytes = 0;
+    for(size_t i = start; i < entries.size() && batch->mutations_size() < (int)max && bytes < max_bytes; i++){
+      *batch->add_mutations() = entries[i].m;
+      bytes += entries[i].m.ByteSizeLong();
+    }
+    return batch->mutations_size() > 0;
+  }
 
-//Helper function used to find a Client object given its username
-int find_user(std::string username){
-  int index = 0;
-  for(Client* c : client_db){
-    if(c->username == username)
-      return index;
-    index++;
+  //When the mutation was appended, if it is still buffered
+  bool appended_at(uint64_t seq, std::chrono::steady_clock::time_point* at){
+    std::lock_guard<std::mutex> guard(mu);
+    if(entries.empty() || seq < entries.front().m.seq() || seq > last_seq)
+      return false;
+    *at = entries[seq - entries.front().m.seq()].at;
+    return true;
+  }
+
+  //Records a mutation applied as a slave
+  void applied(uint64_t seq){
+    std::lock_guard<std::mutex> guard(mu);
+    last_seq = std::max(last_seq, seq);
+  }
+
+  //Takes over the master's log as of a snapshot applied as a slave
+  void reset(uint64_t epoch, uint64_t seq){
+    std::lock_guard<std::mutex> guard(mu);
+    log_epoch = epoch;
+    last_seq = seq;
+    entries.clear();
+  }
+
+  uint64_t last(){
+    std::lock_guard<std::mutex> guard(mu);
+    return last_seq;
+  }
+
+  uint64_t epoch(){
+    std::lock_guard<std::mutex> guard(mu);
+    return log_epoch;
+  }
+
+  std::atomic<long> replication_appends{0};
+  std::atomic<long> replication_append_ns{0};
+
+private:
+  struct Entry {
+    peer::Mutation m;
+    std::chrono::steady_clock::time_point at;
+  };
+  const size_t capacity;
+  std::mutex mu;
+  std::condition_variable cv;
+  std::deque<Entry> entries;
+  uint64_t log_epoch = 0;
+  uint64_t last_seq = 0;
+};
+//Mutations buffered for slaves, -r
+size_t replication_buffer = 100000;
+//Mutations sent to a slave but not yet acknowledged, -w
+size_t replication_window = 8192;
+const size_t REPLICATION_BATCH = 512;
+const size_t REPLICATION_BATCH_BYTES = 4 << 20;
+ReplicationLog* replication_log;
+
+//Per slave progress, reported by ReportStats
+struct SlaveProgress {
+  uint64_t acked = 0;
+  //Worst append-to-ack time since the last report
+  long max_lag_ms = 0;
+};
+std::mutex progress_mutex;
+std::map<int, SlaveProgress> slave_progress;
+
+//Held shared by each replicated change from before it takes any other lock
+//until it has replicated, and exclusively while a snapshot is taken, so a
+//snapshot matches one position in the log
+std::shared_mutex change_mutex;
+
+//Called by the handlers below for every change they make, while still
+//holding the locks that order it against other changes to the same users,
+//so slaves replay changes in the order they took effect here
+void replicate(peer::Mutation& m){
+  if(is_master)
+    replication_log->append(m);
+}
+
+//Protocol independent handlers shared by both service versions
+
+//Directory holding the timeline files, -d
+std::string data_dir = ".";
+
+//Files shared with this cluster's synchronizer, under data_dir:
+//users.txt lists the users created here, remote_users.txt the users of
+//other clusters, and remote_follows.txt gets "+user target" or "-user target"
+//for every follow and unfollow of a remote user
+const std::string USERS_FILE = "/users.txt";
+const std::string REMOTE_USERS_FILE = "/remote_users.txt";
+const std::string REMOTE_FOLLOWS_FILE = "/remote_follows.txt";
+
+//Creates a user. Must be called with db_mutex held
+Client* add_user(const std::string& username, bool remote = false){
+  Client* c = new Client();
+  c->username = username;
+  c->timeline_file = data_dir + "/" + username + ".txt";
+  c->following_file = data_dir + "/" + username + "following.txt";
+  c->id = client_db.add(c);
+  user_ids[c->username] = c->id;
+  //Number on from where the files left off before a restart
+  std::ifstream base(c->following_file + ".base");
+  uint64_t first = 1;
+  if(base >> first)
+    c->following_base = first;
+  c->next_seq = first + read_records(c->following_file).size();
+  if(remote){
+    c->remote = true;
+    c->connected = false;
+    return c;
+  }
+  append_to_file(data_dir + USERS_FILE, username + "\n");
+  peer::Mutation m;
+  m.set_login(username);
+  replicate(m);
+  return c;
+}
+
+//Looks the user up among those the synchronizer has seen on other clusters
+//and adds them here if found. Returns their id, -1 if unknown
+int find_remote_user(const std::string& username){
+  std::ifstream in(data_dir + REMOTE_USERS_FILE);
+  std::string line;
+  while(getline(in, line)){
+    if(line != username) continue;
+    std::lock_guard<std::mutex> guard(db_mutex);
+    auto it = user_ids.find(username);
+    return it != user_ids.end() ? it->second : add_user(username, true)->id;
   }
   return -1;
 }
 
+StatusCode login_user(const std::string& username, bool* returning){
+  std::shared_lock<std::shared_mutex> change(change_mutex);
+  std::unique_lock<std::mutex> guard(db_mutex);
+  auto it = user_ids.find(username);
+  if(it == user_ids.end()){
+    add_user(username);
+    *returning = false;
+    return v2::STATUS_OK;
+  }
+  Client *user = client_db[it->second];
+  guard.unlock();
+  if(user->connected) {
+    log(WARNING, "User already logged on");
+    return v2::STATUS_ALREADY_LOGGED_IN;
+  }
+  user->connected = true;
+  *returning = true;
+  return v2::STATUS_OK;
+}
+
+StatusCode list_users(const std::string& username, ListReply* list_reply){
+  int user_index = find_user(username);
+  if(user_index < 0)
+    return v2::STATUS_UNKNOWN_USER;
+  Client* user = client_db[user_index];
+
+  size_t user_count = client_db.size();
+  for(UserId id = 0; id < user_count; id++){
+    list_reply->add_all_users(client_db[id]->username);
+  }
+  std::lock_guard<std::mutex> guard(user->graph_mutex);
+  for(UserId follower : user->client_followers){
+    list_reply->add_followers(client_db[follower]->username);
+  }
+  return v2::STATUS_OK;
+}
+
+StatusCode follow_user(const std::string& username1, const std::string& username2){
+  std::shared_lock<std::shared_mutex> change(change_mutex);
+  int join_index = find_user(username2);
+  if(join_index < 0 && username1 != username2)
+    join_index = find_remote_user(username2);
+  if(join_index < 0 || username1 == username2)
+    return v2::STATUS_INVALID_USERNAME;
+  int user_index = find_user(username1);
+  if(user_index < 0)
+    return v2::STATUS_UNKNOWN_USER;
+  Client *user1 = client_db[user_index];
+  Client *user2 = client_db[join_index];
+  std::unique_lock<std::mutex> lock1(user1->graph_mutex, std::defer_lock);
+  std::unique_lock<std::mutex> lock2(user2->graph_mutex, std::defer_lock);
+  std::lock(lock1, lock2);
+  if(std::find(user1->client_following.begin(), user1->client_following.end(), user2->id) != user1->client_following.end())
+    return v2::STATUS_ALREADY_FOLLOWING;
+  user1->client_following.push_back(user2->id);
+  user2->client_followers.push_back(user1->id);
+  if(user2->remote)
+    append_to_file(data_dir + REMOTE_FOLLOWS_FILE, "+" + username1 + " " + username2 + "\n");
+  peer::Mutation m;
+  m.mutable_follow()->set_username(username1);
+  m.mutable_follow()->set_target(username2);
+  replicate(m);
+  return v2::STATUS_OK;
+}
+
+StatusCode unfollow_user(const std::string& username1, const std::string& username2){
+  std::shared_lock<std::shared_mutex> change(change_mutex);
+  int leave_index = find_user(username2);
+  if(leave_index < 0 || username1 == username2)
+    return v2::STATUS_INVALID_USERNAME;
+  int user_index = find_user(username1);
+  if(user_index < 0)
+    return v2::STATUS_UNKNOWN_USER;
+  Client *user1 = client_db[user_index];
+  Client *user2 = client_db[leave_index];
+  std::unique_lock<std::mutex> lock1(user1->graph_mutex, std::defer_lock);
+  std::unique_lock<std::mutex> lock2(user2->graph_mutex, std::defer_lock);
+  std::lock(lock1, lock2);
+  auto it = std::find(user1->client_following.begin(), user1->client_following.end(), user2->id);
+  if(it == user1->client_following.end())
+    return v2::STATUS_NOT_A_FOLLOWER;
+  user1->client_following.erase(it);
+  user2->client_followers.erase(std::find(user2->client_followers.begin(), user2->client_followers.end(), user1->id));
+  if(user2->remote)
+    append_to_file(data_dir + REMOTE_FOLLOWS_FILE, "-" + username1 + " " + username2 + "\n");
+  peer::Mutation m;
+  m.mutable_unfollow()->set_username(username1);
+  m.mutable_unfollow()->set_target(username2);
+  replicate(m);
+  return v2::STATUS_OK;
+}
+
+struct BulkFollowResult {
+  uint64_t applied = 0;
+  uint64_t duplicates = 0;
+  uint64_t invalid = 0;
+};
+
+//Names resolved per hold of db_mutex in follow_users, so a large import
+//doesn't keep find_user waiting
+const size_t RESOLVE_CHUNK = 1024;
+//Follows per replicated follow_batch, so a large import is sent to slaves
+//as several mutations well under their SNAPSHOT_MAX_MESSAGE limit
+const int FOLLOW_BATCH_MAX = 10000;
+
+//Applies many follows at once, as (follower, followee) pairs. Names are
+//resolved a chunk at a time, sorting drops repeated edges, and each affected
+//user is locked once, in id order, for the whole change and its replication,
+//so lists are grown once rather than per edge. Edges naming an unknown user
+//are invalid unless create_users is set.
+BulkFollowResult follow_users(const std::vector<std::pair<std::string, std::string>>& edges, bool create_users){
+  std::shared_lock<std::shared_mutex> change(change_mutex);
+  BulkFollowResult result;
+  std::unordered_map<std::string, int> ids;
+  std::vector<const std::string*> names;
+  for(auto& e : edges){
+    for(const std::string* name : {&e.first, &e.second}){
+      if(ids.emplace(*name, -1).second)
+        names.push_back(name);
+    }
+  }
+  std::vector<const std::string*> missing;
+  for(size_t i = 0; i < names.size(); i += RESOLVE_CHUNK){
+    std::lock_guard<std::mutex> guard(db_mutex);
+    for(size_t j = i; j < std::min(names.size(), i + RESOLVE_CHUNK); j++){
+      auto it = user_ids.find(*names[j]);
+      if(it != user_ids.end())
+        ids[*names[j]] = it->second;
+      else if(create_users && !names[j]->empty())
+        missing.push_back(names[j]);
+    }
+  }
+  //New users are created one per hold of db_mutex, as at Login, since add_user does file I/O
+  for(const std::string* name : missing){
+    std::lock_guard<std::mutex> guard(db_mutex);
+    auto it = user_ids.find(*name);
+    if(it != user_ids.end()){
+      ids[*name] = it->second;
+      continue;
+    }
+    //Created logged out, so the user can log in later
+    Client* c = add_user(*name);
+    c->connected = false;
+    ids[*name] = c->id;
+  }
+
+  std::vector<std::pair<UserId, UserId>> pairs;
+  pairs.reserve(edges.size());
+  for(auto& e : edges){
+    int follower = ids[e.first];
+    int followee = ids[e.second];
+    if(follower < 0 || followee < 0 || follower == followee){
+      result.invalid++;
+      continue;
+    }
+    pairs.emplace_back(follower, followee);
+  }
+  std::sort(pairs.begin(), pairs.end());
+  size_t unique = std::unique(pairs.begin(), pairs.end()) - pairs.begin();
+  result.duplicates = pairs.size() - unique;
+  pairs.resize(unique);
+
+  //Lock everyone affected in id order; follow_user's std::lock backs off
+  //rather than deadlocking against this
+  std::vector<UserId> affected;
+  affected.reserve(pairs.size() * 2);
+  for(auto& p : pairs){
+    affected.push_back(p.first);
+    affected.push_back(p.second);
+  }
+  std::sort(affected.begin(), affected.end());
+  affected.erase(std::unique(affected.begin(), affected.end()), affected.end());
+  std::vector<std::unique_lock<std::mutex>> locks;
+  locks.reserve(affected.size());
+  for(UserId id : affected)
+    locks.emplace_back(client_db[id]->graph_mutex);
+
+  //Following lists, grouped by follower
+  std::vector<std::pair<UserId, UserId>> added;
+  added.reserve(pairs.size());
+  for(size_t i = 0; i < pairs.size(); ){
+    size_t end = i;
+    while(end < pairs.size() && pairs[end].first == pairs[i].first)
+      end++;
+    Client* user = client_db[pairs[i].first];
+    std::vector<UserId> existing(user->client_following);
+    std::sort(existing.begin(), existing.end());
+    user->client_following.reserve(user->client_following.size() + (end - i));
+    for(; i < end; i++){
+      if(std::binary_search(existing.begin(), existing.end(), pairs[i].second)){
+        result.duplicates++;
+        continue;
+      }
+      user->client_following.push_back(pairs[i].second);
+      added.emplace_back(pairs[i].second, pairs[i].first);
+    }
+  }
+
+  //Followers lists, grouped by followee
+  std::sort(added.begin(), added.end());
+  std::vector<peer::Mutation> batches;
+  std::string remote_follows;
+  for(size_t i = 0; i < added.size(); ){
+    size_t end = i;
+    while(end < added.size() && added[end].first == added[i].first)
+      end++;
+    Client* user = client_db[added[i].first];
+    user->client_followers.reserve(user->client_followers.size() + (end - i));
+    for(; i < end; i++){
+      Client* follower = client_db[added[i].second];
+      user->client_followers.push_back(follower->id);
+      if(batches.empty() || batches.back().follow_batch().follows_size() >= FOLLOW_BATCH_MAX)
+        batches.emplace_back();
+      peer::FollowChange* f = batches.back().mutable_follow_batch()->add_follows();
+      f->set_username(follower->username);
+      f->set_target(user->username);
+      if(user->remote)
+        remote_follows += "+" + follower->username + " " + user->username + "\n";
+    }
+  }
+  result.applied = added.size();
+  if(!remote_follows.empty())
+    append_to_file(data_dir + REMOTE_FOLLOWS_FILE, remote_follows);
+  //Still under the locks, so the batches are ordered against single follows of the same users
+  for(auto& m : batches)
+    replicate(m);
+  return result;
+}
+
+//Posts a user's Timeline stream can resume from without going to disk
+const size_t RECENT_POSTS = 128;
+
+//Collects the posts with after_seq < seq < before_seq from the recent ones
+//kept in memory, or from following_file if they have been dropped from there.
+//Must be called with stream_mutex held
+std::vector<Message> read_backlog(Client* c, uint64_t after_seq, uint64_t before_seq){
+  std::vector<Message> backlog;
+  if(!c->recent.empty() && c->recent.front().seq() <= after_seq + 1){
+    for(auto& m : c->recent){
+      if(m.seq() > after_seq && m.seq() < before_seq)
+        backlog.push_back(m);
+    }
+    return backlog;
+  }
+  std::lock_guard<std::mutex> file_guard(file_lock(c->following_file));
+  std::vector<std::string> records = read_records(c->following_file);
+  uint64_t seq = c->following_base;
+  if(seq > after_seq + 1)
+    log(WARNING, c->username + " resumed at " + std::to_string(after_seq + 1)
+        + " but compaction has dropped everything before " + std::to_string(seq));
+  Message m;
+  for(auto& record : records){
+    if(seq > after_seq && seq < before_seq && parse_record(record, &m)){
+      m.set_seq(seq);
+      backlog.push_back(m);
+    }
+    seq++;
+  }
+  return backlog;
+}
+
+//Attaches the sink to the client and queues what the stream missed in the
+//inbox, for a CatchUp to send: the posts after after_seq, or with after_seq 0
+//the newest 20 or the offline inbox, whichever goes further back.
+void open_timeline(Client* c, TimelineSink* sink, uint64_t after_seq = 0){
+  std::lock_guard<std::mutex> guard(c->stream_mutex);
+  if(after_seq == 0){
+    after_seq = c->next_seq > 21 ? c->next_seq - 21 : 0;
+    if(!c->inbox.empty())
+      after_seq = std::min(after_seq, c->inbox.front().seq() - 1);
+  }
+  //The inbox holds the newest posts without gaps, so only what comes
+  //before it has to be looked up
+  while(!c->inbox.empty() && c->inbox.front().seq() <= after_seq)
+    c->inbox.pop_front();
+  uint64_t inbox_start = c->inbox.empty() ? c->next_seq : c->inbox.front().seq();
+  if(after_seq + 1 < inbox_start){
+    std::vector<Message> older = read_backlog(c, after_seq, inbox_start);
+    c->inbox.insert(c->inbox.begin(), older.begin(), older.end());
+  }
+  c->stream = sink;
+  c->catching_up = !c->inbox.empty();
+  c->connected = true;
+}
+
+//Detaches the sink when its stream ends
+void close_timeline(Client* c, TimelineSink* sink){
+  {
+    std::lock_guard<std::mutex> guard(c->stream_mutex);
+    if(c->stream == sink){
+      c->stream = 0;
+      c->catching_up = false;
+    }
+  }
+  //If the client disconnected from Chat Mode, set connected to false
+  c->connected = false;
+}
+
+//Sends a reconnected stream its inbox in batches, paced so a large backlog
+//can't monopolize the server, then hands the stream over to live delivery.
+//One per Timeline stream; stop() before the stream is reopened or closed.
+class CatchUp {
+public:
+  ~CatchUp(){
+    stop();
+  }
+  void start(Client* c, TimelineSink* sink){
+    stop();
+    stopping = false;
+    worker = std::thread(&CatchUp::Run, this, c, sink);
+  }
+  void stop(){
+    stopping = true;
+    if(worker.joinable())
+      worker.join();
+  }
+private:
+  void Run(Client* c, TimelineSink* sink){
+    std::vector<Message> batch;
+    while(!stopping){
+      {
+        std::lock_guard<std::mutex> guard(c->stream_mutex);
+        if(c->stream != sink)
+          return;
+        if(c->inbox.empty()){
+          c->catching_up = false;
+          return;
+        }
+        size_t n = std::min(c->inbox.size(), (size_t)offline.catchup_batch);
+        batch.assign(std::make_move_iterator(c->inbox.begin()), std::make_move_iterator(c->inbox.begin() + n));
+        c->inbox.erase(c->inbox.begin(), c->inbox.begin() + n);
+      }
+      //Only this thread queues posts on the sink while catching_up is set
+      for(auto& m : batch){
+        if(!sink->Write(m))
+          return;
+      }
+      catchup_posts += batch.size();
+      std::this_thread::sleep_for(std::chrono::milliseconds(offline.catchup_interval_ms));
+    }
+  }
+
+  std::atomic<bool> stopping{false};
+  std::thread worker;
+};
+
+//Sorts and dedups the ids and locks each user's stream_mutex, in id order.
+//A post is replicated with its recipients locked, so every recipient
+//numbers posts in the order the slaves replay them
+std::vector<std::unique_lock<std::mutex>> lock_streams(std::vector<UserId>& ids){
+  std::sort(ids.begin(), ids.end());
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+  std::vector<std::unique_lock<std::mutex>> locks;
+  locks.reserve(ids.size());
+  for(UserId id : ids)
+    locks.emplace_back(client_db[id]->stream_mutex);
+  return locks;
+}
+
+//Queues a post on a follower's stream, if open, and adds it to their files.
+//Must be called with the follower's stream_mutex held, see lock_streams
+void deliver_post(Client* follower, const Message& message, const std::string& record){
+  Message entry = message;
+  entry.set_seq(follower->next_seq++);
+  if(follower->stream!=0 && follower->connected && !follower->catching_up){
+    follower->stream->Write(entry);
+  }else{
+    follower->inbox.push_back(entry);
+    if(follower->inbox.size() > (size_t)offline.max_posts){
+      follower->inbox.pop_front();
+      inbox_dropped++;
+    }
+  }
+  follower->recent.push_back(entry);
+  if(follower->recent.size() > RECENT_POSTS)
+    follower->recent.pop_front();
+  //For each of the current user's followers, put the message in their following.txt file.
+  //Still under stream_mutex, so records land in sequence order
+  append_to_file(follower->following_file, record);
+  follower->following_file_size++;
+  append_to_file(follower->timeline_file, record);
+}
+
+//Records a post in the poster's file and delivers it to every follower
+void post_message(Client* c, const Message& message){
+  std::shared_lock<std::shared_mutex> change(change_mutex);
+  peer::Mutation m;
+  *m.mutable_post() = message;
+  std::string fileinput = timeline_record(message);
+
+  //Replicated under the poster's graph lock, ordering it against follows of
+  //the poster, and with the followers' streams locked
+  auto fanout_start = std::chrono::steady_clock::now();
+  std::vector<UserId> followers;
+  std::vector<std::unique_lock<std::mutex>> streams;
+  {
+    std::lock_guard<std::mutex> guard(c->graph_mutex);
+    followers = c->client_followers;
+    streams = lock_streams(followers);
+    replicate(m);
+  }
+  //Write the current message to "username.txt"
+  append_to_file(c->timeline_file, fileinput);
+
+  //Send the message to each follower's stream
+  for(UserId follower : followers)
+    deliver_post(client_db[follower], message, fileinput);
+  long fanout_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - fanout_start).count();
+  fanout_time_us += fanout_us;
+  fanout_deliveries += followers.size();
+  log(INFO, "Fan-out to " + std::to_string(followers.size()) + " followers took "
+      + std::to_string(fanout_us) + " us");
+}
+
+//Posts from other clusters handed over by DeliverBatch, and how long they
+//took to get here from when they were posted, reported by the stats thread
+std::atomic<long> remote_posts{0};
+std::atomic<long> remote_latency_ms{0};
+
+//Ids of the most recent remote deliveries, so a DeliverBatch the
+//synchronizer retries after a timeout doesn't post twice
+const size_t DELIVERY_IDS = 100000;
+std::mutex delivery_ids_mutex;
+std::unordered_set<std::string> delivery_ids;
+std::deque<std::string> delivery_id_order;
+std::atomic<long> remote_duplicates{0};
+
+//False if a delivery with this id was already applied; remembers it otherwise
+bool first_delivery(const std::string& id){
+  if(id.empty())
+    return true;
+  std::lock_guard<std::mutex> guard(delivery_ids_mutex);
+  if(!delivery_ids.insert(id).second)
+    return false;
+  delivery_id_order.push_back(id);
+  if(delivery_id_order.size() > DELIVERY_IDS){
+    delivery_ids.erase(delivery_id_order.front());
+    delivery_id_order.pop_front();
+  }
+  return true;
+}
+
+//Delivers a post from another cluster to its recipients here. Returns how many it reached
+int deliver_remote(const peer::Delivery& delivery){
+  std::shared_lock<std::shared_mutex> change(change_mutex);
+  if(!first_delivery(delivery.id())){
+    remote_duplicates++;
+    return 0;
+  }
+  peer::Mutation m;
+  *m.mutable_deliver() = delivery;
+  std::string record = timeline_record(delivery.post());
+  std::vector<UserId> recipients;
+  for(auto& recipient : delivery.recipients()){
+    int user_index = find_user(recipient);
+    if(user_index >= 0)
+      recipients.push_back(user_index);
+  }
+  std::vector<std::unique_lock<std::mutex>> streams = lock_streams(recipients);
+  replicate(m);
+  for(UserId recipient : recipients)
+    deliver_post(client_db[recipient], delivery.post(), record);
+  return recipients.size();
+}
+
 class SNSServiceImpl final : public SNSService::Service {
   
   Status List(ServerContext* context, const Request* request, ListReply* list_reply) override {
     log(INFO,"Serving List Request from: " + request->username()  + "\n");
-     
-    Client* user = client_db[find_user(request->username())];
- 
-    int index = 0;
-    for(Client* c : client_db){
-      list_reply->add_all_users(c->username);
-    }
-    std::vector<Client*>::const_iterator it;
-    for(it = user->client_followers.begin(); it!=user->client_followers.end(); it++){
-      list_reply->add_followers((*it)->username);
-    }
+    list_users(request->username(), list_reply);
     return Status::OK;
   }
 
@@ -124,19 +1210,15 @@ class SNSServiceImpl final : public SNSService::Service {
     std::string username2 = request->arguments(0);
     log(INFO,"Serving Follow Request from: " + username1 + " for: " + username2 + "\n");
 
-    int join_index = find_user(username2);
-    if(join_index < 0 || username1 == username2)
-      reply->set_msg("Join Failed -- Invalid Username");
-    else{
-      Client *user1 = client_db[find_user(username1)];
-      Client *user2 = client_db[join_index];      
-      if(std::find(user1->client_following.begin(), user1->client_following.end(), user2) != user1->client_following.end()){
-	reply->set_msg("Join Failed -- Already Following User");
-        return Status::OK;
-      }
-      user1->client_following.push_back(user2);
-      user2->client_followers.push_back(user1);
-      reply->set_msg("Follow Successful");
+    switch(follow_user(username1, username2)){
+      case v2::STATUS_OK:
+        reply->set_msg("Follow Successful");
+        break;
+      case v2::STATUS_ALREADY_FOLLOWING:
+        reply->set_msg("Join Failed -- Already Following User");
+        break;
+      default:
+        reply->set_msg("Join Failed -- Invalid Username");
     }
     return Status::OK; 
   }
@@ -146,168 +1228,795 @@ class SNSServiceImpl final : public SNSService::Service {
     std::string username2 = request->arguments(0);
     log(INFO,"Serving Unfollow Request from: " + username1 + " for: " + username2);
  
-    int leave_index = find_user(username2);
-    if(leave_index < 0 || username1 == username2) {
-      reply->set_msg("Unknown follower");
-    } else{
-      Client *user1 = client_db[find_user(username1)];
-      Client *user2 = client_db[leave_index];
-      if(std::find(user1->client_following.begin(), user1->client_following.end(), user2) == user1->client_following.end()){
-	reply->set_msg("You are not a follower");
-        return Status::OK;
-      }
-      
-      user1->client_following.erase(find(user1->client_following.begin(), user1->client_following.end(), user2)); 
-      user2->client_followers.erase(find(user2->client_followers.begin(), user2->client_followers.end(), user1));
-      reply->set_msg("UnFollow Successful");
+    switch(unfollow_user(username1, username2)){
+      case v2::STATUS_OK:
+        reply->set_msg("UnFollow Successful");
+        break;
+      case v2::STATUS_NOT_A_FOLLOWER:
+        reply->set_msg("You are not a follower");
+        break;
+      default:
+        reply->set_msg("Unknown follower");
     }
     return Status::OK;
   }
 
   // RPC Login
   Status Login(ServerContext* context, const Request* request, Reply* reply) override {
-    Client* c = new Client();
     std::string username = request->username();
     log(INFO, "Serving Login Request: " + username + "\n");
     
-    int user_index = find_user(username);
-    if(user_index < 0){
-      c->username = username;
-      client_db.push_back(c);
+    bool returning = false;
+    if(login_user(username, &returning) != v2::STATUS_OK)
+      reply->set_msg("you have already joined");
+    else if(returning)
+      reply->set_msg("Welcome Back " + username);
+    else
       reply->set_msg("Login Successful!");
-    }
-    else{
-      Client *user = client_db[user_index];
-      if(user->connected) {
-	log(WARNING, "User already logged on");
-        reply->set_msg("you have already joined");
-      }
-      else{
-        std::string msg = "Welcome Back " + user->username;
-	reply->set_msg(msg);
-        user->connected = true;
-      }
-    }
     return Status::OK;
   }
 
   Status Timeline(ServerContext* context, 
 		ServerReaderWriter<Message, Message>* stream) override {
     log(INFO,"Serving Timeline Request");
+    TimelineSinkV1 sink(stream);
+    CatchUp catchup;
     Message message;
-    Client *c;
+    //The Client this stream is bound to, resolved once for the stream's lifetime
+    Client *c = nullptr;
+    auto session_user = context->client_metadata().find(SESSION_USER_KEY);
+    if(session_user != context->client_metadata().end()){
+      int user_index = find_user(std::string(session_user->second.data(), session_user->second.length()));
+      if(user_index >= 0)
+        c = client_db[user_index];
+    }
     while(stream->Read(&message)) {
-      std::string username = message.username();
-      int user_index = find_user(username);
-      c = client_db[user_index];
+      if(message.username().empty()){
+        if(!c){
+          log(WARNING, "Timeline message without a username on an unbound stream");
+          continue;
+        }
+        message.set_username(c->username);
+      } else if(!c || c->username != message.username()){
+        int user_index = find_user(message.username());
+        if(user_index < 0){
+          log(WARNING, "Timeline message from unknown user " + message.username());
+          continue;
+        }
+        c = client_db[user_index];
+      }
  
-      //Write the current message to "username.txt"
-      std::string filename = username+".txt";
-      std::ofstream user_file(filename,std::ios::app|std::ios::out|std::ios::in);
-      google::protobuf::Timestamp temptime = message.timestamp();
-      std::string time = google::protobuf::util::TimeUtil::ToString(temptime);
-      std::string fileinput = time+" :: "+message.username()+":"+message.msg()+"\n";
       //"Set Stream" is the default message from the client to initialize the stream
       if(message.msg() != "Set Stream")
-        user_file << fileinput;
-      //If message = "Set Stream", print the first 20 chats from the people you follow
+        post_message(c, message);
+      //If message = "Set Stream", send the posts missed since message.seq(), or the newest 20
       else{
-        if(c->stream==0)
-      	  c->stream = stream;
-        std::string line;
-        std::vector<std::string> newest_twenty;
-        std::ifstream in(username+"following.txt");
-        int count = 0;
-        //Read the last up-to-20 lines (newest 20 messages) from userfollowing.txt
-        while(getline(in, line)){
-//          count++;
-//          if(c->following_file_size > 20){
-//	    if(count < c->following_file_size-20){
-//	      continue;
-//            }
-//          }
-          newest_twenty.push_back(line);
-        }
-        Message new_msg; 
- 	//Send the newest messages to the client to be displayed
- 	if(newest_twenty.size() >= 40){ 	
-	    for(int i = newest_twenty.size()-40; i<newest_twenty.size(); i+=2){
-	       new_msg.set_msg(newest_twenty[i]);
-	       stream->Write(new_msg);
-	    }
-        }else{
-	    for(int i = 0; i<newest_twenty.size(); i+=2){
-	       new_msg.set_msg(newest_twenty[i]);
-	       stream->Write(new_msg);
-	    }
+        catchup.stop();
+        open_timeline(c, &sink, message.seq());
+        catchup.start(c, &sink);
+      }
+    }
+    catchup.stop();
+    if(c)
+      close_timeline(c, &sink);
+    return Status::OK;
+  }
+
+};
+
+//Version 2 of the service: typed status codes and control messages, no string matching
+class SNSServiceV2Impl final : public v2::SNSService::Service {
+
+  Status List(ServerContext* context, const Request* request, ListReply* list_reply) override {
+    log(INFO,"Serving v2 List Request from: " + request->username());
+    if(list_users(request->username(), list_reply) != v2::STATUS_OK)
+      return Status(grpc::StatusCode::NOT_FOUND, "unknown user");
+    return Status::OK;
+  }
+
+  Status Follow(ServerContext* context, const Request* request, v2::Reply* reply) override {
+    if(request->arguments_size() < 1)
+      return Status(grpc::StatusCode::INVALID_ARGUMENT, "missing username to follow");
+    log(INFO,"Serving v2 Follow Request from: " + request->username() + " for: " + request->arguments(0));
+    reply->set_status(follow_user(request->username(), request->arguments(0)));
+    return Status::OK;
+  }
+
+  Status UnFollow(ServerContext* context, const Request* request, v2::Reply* reply) override {
+    if(request->arguments_size() < 1)
+      return Status(grpc::StatusCode::INVALID_ARGUMENT, "missing username to unfollow");
+    log(INFO,"Serving v2 Unfollow Request from: " + request->username() + " for: " + request->arguments(0));
+    reply->set_status(unfollow_user(request->username(), request->arguments(0)));
+    return Status::OK;
+  }
+
+  Status BulkFollow(ServerContext* context, const v2::BulkFollowRequest* request, v2::BulkFollowReply* reply) override {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::pair<std::string, std::string>> edges;
+    edges.reserve(request->edges_size());
+    for(auto& e : request->edges())
+      edges.emplace_back(e.follower(), e.followee());
+    BulkFollowResult result = follow_users(edges, request->create_users());
+    reply->set_applied(result.applied);
+    reply->set_duplicates(result.duplicates);
+    reply->set_invalid(result.invalid);
+    long elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    long rate = elapsed_us > 0 ? (long)(edges.size() * 1000000 / elapsed_us) : 0;
+    log(INFO, "BulkFollow applied " + std::to_string(result.applied) + " of " + std::to_string(edges.size())
+        + " edges in " + std::to_string(elapsed_us / 1000) + " ms (" + std::to_string(rate) + " edges/s)");
+    return Status::OK;
+  }
+
+  Status Login(ServerContext* context, const Request* request, v2::Reply* reply) override {
+    log(INFO, "Serving v2 Login Request: " + request->username());
+    bool returning = false;
+    reply->set_status(login_user(request->username(), &returning));
+    if(reply->status() == v2::STATUS_OK && returning)
+      reply->set_msg("Welcome Back " + request->username());
+    return Status::OK;
+  }
+
+  Status Timeline(ServerContext* context,
+		ServerReaderWriter<v2::TimelineEvent, v2::TimelineRequest>* stream) override {
+    log(INFO,"Serving v2 Timeline Request");
+    TimelineSinkV2 sink(stream);
+    CatchUp catchup;
+    v2::TimelineRequest request;
+    //Reused for every post so its buffers are only allocated once per stream
+    Message message;
+    Client *c = nullptr;
+    while(stream->Read(&request)) {
+      switch(request.kind_case()){
+        case v2::TimelineRequest::kSetStream: {
+          catchup.stop();
+          int user_index = find_user(request.set_stream().username());
+          if(user_index < 0){
+            if(c)
+              close_timeline(c, &sink);
+            return Status(grpc::StatusCode::NOT_FOUND, "unknown user");
+          }
+          if(c && c != client_db[user_index])
+            close_timeline(c, &sink);
+          c = client_db[user_index];
+          message.set_username(c->username);
+          open_timeline(c, &sink, request.set_stream().last_seq());
+          catchup.start(c, &sink);
+          break;
         }
-        //std::cout << "newest_twenty.size() " << newest_twenty.size() << std::endl; 
+        case v2::TimelineRequest::kPost:
+          if(!c)
+            return Status(grpc::StatusCode::FAILED_PRECONDITION, "post before set_stream");
+          message.set_msg(request.post().msg());
+          *message.mutable_timestamp() = request.post().timestamp();
+          post_message(c, message);
+          break;
+        default:
+          log(WARNING, "Ignoring empty v2 Timeline request");
+      }
+    }
+    catchup.stop();
+    if(c)
+      close_timeline(c, &sink);
+    return Status::OK;
+  }
+
+};
+
+//Seconds of CPU time used by this process so far
+double cpu_seconds(){
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+      + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+//Heap bytes of a string beyond what sizeof(Client) already counts
+size_t string_bytes(const std::string& s){
+  return s.capacity() >= sizeof(std::string) ? s.capacity() + 1 : 0;
+}
+
+//Bytes of memory held for users: each Client with its names, follow lists,
+//recent posts and inbox, and the user_ids index
+long user_memory_bytes(){
+  size_t user_count = client_db.size();
+  long bytes = 0;
+  for(UserId id = 0; id < user_count; id++){
+    Client* c = client_db[id];
+    bytes += sizeof(Client) + string_bytes(c->username) + string_bytes(c->timeline_file)
+        + string_bytes(c->following_file);
+    {
+      std::lock_guard<std::mutex> guard(c->graph_mutex);
+      bytes += (c->client_followers.capacity() + c->client_following.capacity()) * sizeof(UserId);
+    }
+    std::lock_guard<std::mutex> guard(c->stream_mutex);
+    for(auto& m : c->recent)
+      bytes += m.SpaceUsedLong();
+    for(auto& m : c->inbox)
+      bytes += m.SpaceUsedLong();
+  }
+  std::lock_guard<std::mutex> guard(db_mutex);
+  //a hash node holds the key, the id and a next pointer; buckets are pointers
+  for(auto& entry : user_ids)
+    bytes += sizeof(entry) + sizeof(void*) + string_bytes(entry.first);
+  bytes += user_ids.bucket_count() * sizeof(void*);
+  return bytes;
+}
+
+long resident_bytes(){
+  std::ifstream statm("/proc/self/statm");
+  long pages = 0, resident = 0;
+  statm >> pages >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+//Periodically logs Timeline frame and message rates and CPU usage
+void ReportStats(){
+  const int interval = 10;
+  //user memory takes a pass over every user, so it is reported less often
+  const int memory_every = 6;
+  int reports = 0;
+  long last_frames = 0, last_messages = 0;
+  double last_cpu = cpu_seconds();
+  while(true){
+    sleep(interval);
+    long frames = frames_written, messages = messages_written;
+    double cpu = cpu_seconds();
+    log(INFO, "Timeline: " + std::to_string((frames - last_frames) / interval) + " frames/s, "
+        + std::to_string((messages - last_messages) / interval) + " msgs/s, CPU "
+        + std::to_string((int)(100 * (cpu - last_cpu) / interval)) + "%");
+    last_frames = frames;
+    last_messages = messages;
+    last_cpu = cpu;
+
+    long deliveries = fanout_deliveries.exchange(0), fanout_us = fanout_time_us.exchange(0);
+    if(deliveries){
+      log(INFO, "Fan-out: " + std::to_string(deliveries / interval) + " deliveries/s, "
+          + std::to_string((double)fanout_us / deliveries) + " us per delivery");
+    }
+    if(++reports % memory_every == 0){
+      long users = client_db.size();
+      if(users){
+        long state = user_memory_bytes(), rss = resident_bytes();
+        log(INFO, "Memory: " + std::to_string(users) + " users, " + std::to_string(state / users)
+            + " bytes/user of user state, RSS " + std::to_string(rss / (1024 * 1024)) + " MB ("
+            + std::to_string(rss / users) + " bytes/user)");
+      }
+    }
+
+    long caught_up = catchup_posts.exchange(0), dropped = inbox_dropped.exchange(0);
+    if(caught_up || dropped){
+      log(INFO, "Offline inboxes: " + std::to_string(caught_up / interval) + " backlog posts/s sent, "
+          + std::to_string(dropped) + " dropped from full inboxes");
+    }
+
+    long delivered = remote_posts.exchange(0);
+    long latency_ms = remote_latency_ms.exchange(0);
+    long duplicates = remote_duplicates.exchange(0);
+    if(delivered){
+      log(INFO, "Cross-cluster: " + std::to_string(delivered) + " posts delivered, average latency "
+          + std::to_string(latency_ms / delivered) + " ms since posting, "
+          + std::to_string(duplicates) + " retried deliveries skipped");
+    }
+
+    //Cost of replication on the master: appends and their average time,
+    //and how far each slave is behind
+    long appends = replication_log->replication_appends.exchange(0);
+    long append_ns = replication_log->replication_append_ns.exchange(0);
+    if(!is_master) continue;
+    std::string report = "Replication: " + std::to_string(appends / interval) + " mutations/s, "
+        + std::to_string(appends ? append_ns / appends / 1000.0 : 0.0) + " us/append";
+    uint64_t last = replication_log->last();
+    std::lock_guard<std::mutex> guard(progress_mutex);
+    for(auto& slave : slave_progress){
+      report += "; server " + std::to_string(slave.first) + " " + std::to_string(last - slave.second.acked)
+          + " behind, ack lag " + std::to_string(slave.second.max_lag_ms) + " ms";
+      slave.second.max_lag_ms = 0;
+    }
+    log(INFO, report);
+  }
+}
+
+//Milliseconds between heartbeats to the coordinator
+int heartbeat_interval_ms = 250;
+
+//Applies a command pushed by the coordinator over the heartbeat stream
+void handle_command(const CoordCommand& cmd){
+  if(cmd.type() == CoordCommand::PROMOTE && !is_master){
+    log(INFO, "Promoted to master");
+    is_master = true;
+  } else if(cmd.type() == CoordCommand::DEMOTE && is_master){
+    log(INFO, "Demoted to slave");
+    is_master = false;
+  }
+  std::lock_guard<std::mutex> guard(membership_mutex);
+  cluster_master = cmd.master();
+  cluster_members.assign(cmd.members().begin(), cmd.members().end());
+}
+
+bool is_member(int server_id){
+  std::lock_guard<std::mutex> guard(membership_mutex);
+  for(auto& member : cluster_members)
+    if(member.serverid() == server_id) return true;
+  return false;
+}
+
+//Size a snapshot is split into batches at; a single user's state goes in
+//one batch however large, up to the peer's SNAPSHOT_MAX_MESSAGE
+const size_t SNAPSHOT_BATCH_BYTES = 1 << 20;
+const int SNAPSHOT_MAX_MESSAGE = 64 << 20;
+
+//Copies every user's state as it stands at the returned position of log
+//*epoch. Changes wait for it, so the files are read whole with writers held off
+uint64_t take_snapshot(std::vector<peer::UserState>* users, uint64_t* epoch){
+  std::unique_lock<std::shared_mutex> barrier(change_mutex);
+  uint64_t seq = replication_log->last();
+  *epoch = replication_log->epoch();
+  size_t user_count = client_db.size();
+  users->reserve(user_count);
+  for(UserId id = 0; id < user_count; id++){
+    Client* c = client_db[id];
+    peer::UserState state;
+    state.set_username(c->username);
+    state.set_remote(c->remote);
+    {
+      std::lock_guard<std::mutex> guard(c->graph_mutex);
+      for(UserId followee : c->client_following)
+        state.add_following(client_db[followee]->username);
+    }
+    {
+      std::lock_guard<std::mutex> guard(file_lock(c->timeline_file));
+      state.set_timeline(read_file(c->timeline_file));
+    }
+    {
+      //Compaction moves the base with the file's lock held
+      std::lock_guard<std::mutex> guard(file_lock(c->following_file));
+      state.set_following_timeline(read_file(c->following_file));
+      state.set_following_base(c->following_base);
+    }
+    {
+      std::lock_guard<std::mutex> guard(c->stream_mutex);
+      state.set_next_seq(c->next_seq);
+    }
+    users->push_back(std::move(state));
+  }
+  return seq;
+}
+
+//Sends a slave a snapshot to replace its state with. Sets *seq to the log
+//position it matches, where replication carries on from
+bool send_snapshot(grpc::ClientReaderWriter<peer::MutationBatch, peer::ReplicationAck>* stream, uint64_t* seq){
+  auto start = std::chrono::steady_clock::now();
+  std::vector<peer::UserState> users;
+  uint64_t epoch = 0;
+  *seq = take_snapshot(&users, &epoch);
+  long snapshot_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start).count();
+  log(INFO, "Snapshot of " + std::to_string(users.size()) + " users at seq " + std::to_string(*seq)
+      + " took " + std::to_string(snapshot_ms) + " ms");
+  peer::MutationBatch batch;
+  batch.set_snapshot_seq(*seq);
+  batch.set_epoch(epoch);
+  size_t bytes = 0;
+  for(auto& state : users){
+    bytes += state.ByteSizeLong();
+    batch.add_snapshot()->Swap(&state);
+    if(bytes >= SNAPSHOT_BATCH_BYTES){
+      if(!stream->Write(batch))
+        return false;
+      batch.clear_snapshot();
+      bytes = 0;
+    }
+  }
+  batch.set_snapshot_done(true);
+  return stream->Write(batch);
+}
+
+//Streams the replication log to one slave until this server is demoted,
+//the slave leaves the cluster or the stream breaks. Batches are sent
+//without waiting for acks, up to replication_window unacknowledged mutations
+void ReplicateTo(ServerInfo slave){
+  std::string id = std::to_string(slave.serverid());
+  auto stub = peer::PeerService::NewStub(grpc::CreateChannel(
+      slave.hostname() + ":" + slave.port(), grpc::InsecureChannelCredentials()));
+  ClientContext context;
+  std::shared_ptr<grpc::ClientReaderWriter<peer::MutationBatch, peer::ReplicationAck>> stream(
+      stub->Replicate(&context));
+  peer::ReplicationAck ack;
+  if(!stream->Read(&ack)){
+    stream->Finish();
+    return;
+  }
+  uint64_t epoch = replication_log->epoch();
+  uint64_t sent = ack.seq();
+  //A slave with a log of its own, or further along this one than here after
+  //a failover, has nothing to replay from; it takes over a snapshot instead
+  if(ack.epoch() != epoch || ack.seq() > replication_log->last()){
+    log(INFO, "Server " + id + " is at seq " + std::to_string(ack.seq()) + " of another log, resyncing it from a snapshot");
+    if(!send_snapshot(stream.get(), &sent)){
+      context.TryCancel();
+      stream->Finish();
+      return;
+    }
+  }
+  log(INFO, "Replicating to server " + id + " from seq " + std::to_string(sent + 1));
+
+  std::mutex window_mutex;
+  std::condition_variable window_cv;
+  std::atomic<uint64_t> acked{sent};
+  std::atomic<bool> closed{false};
+  std::thread reader([&]() {
+    peer::ReplicationAck a;
+    while(stream->Read(&a)){
+      acked = a.seq();
+      long lag_ms = 0;
+      std::chrono::steady_clock::time_point at;
+      if(replication_log->appended_at(a.seq(), &at))
+        lag_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - at).count();
+      {
+        std::lock_guard<std::mutex> guard(progress_mutex);
+        SlaveProgress& progress = slave_progress[slave.serverid()];
+        progress.acked = a.seq();
+        progress.max_lag_ms = std::max(progress.max_lag_ms, lag_ms);
+      }
+      std::lock_guard<std::mutex> guard(window_mutex);
+      window_cv.notify_all();
+    }
+    closed = true;
+    std::lock_guard<std::mutex> guard(window_mutex);
+    window_cv.notify_all();
+  });
+
+  while(is_master && !closed && is_member(slave.serverid())){
+    {
+      std::unique_lock<std::mutex> guard(window_mutex);
+      if(!window_cv.wait_for(guard, std::chrono::milliseconds(100),
+            [&]() { return closed || sent < acked + replication_window; }))
         continue;
+    }
+    peer::MutationBatch batch;
+    bool gap = false;
+    if(!replication_log->read(sent, REPLICATION_BATCH, REPLICATION_BATCH_BYTES, &batch, &gap, std::chrono::milliseconds(100)))
+      continue;
+    batch.set_epoch(epoch);
+    //What the slave is missing is gone from the buffer, so it takes over a
+    //snapshot of the state instead and carries on from there
+    if(gap){
+      log(WARNING, "Server " + id + " fell behind the replication buffer, resyncing it from a snapshot");
+      uint64_t snapshot_seq = 0;
+      if(!send_snapshot(stream.get(), &snapshot_seq)) break;
+      sent = snapshot_seq;
+      continue;
+    }
+    if(!stream->Write(batch)) break;
+    sent = batch.mutations(batch.mutations_size() - 1).seq();
+  }
+  context.TryCancel();
+  reader.join();
+  stream->Finish();
+  {
+    std::lock_guard<std::mutex> guard(progress_mutex);
+    slave_progress.erase(slave.serverid());
+  }
+  log(INFO, "Stopped replicating to server " + id);
+}
+
+//While this server is master, keeps a replicator running for every slave
+void ManageReplication(int server_id){
+  std::mutex running_mutex;
+  std::set<int> running;
+  while(true){
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    if(!is_master) continue;
+    std::vector<ServerInfo> members;
+    {
+      std::lock_guard<std::mutex> guard(membership_mutex);
+      members = cluster_members;
+    }
+    std::lock_guard<std::mutex> guard(running_mutex);
+    for(auto& member : members){
+      if(member.serverid() == server_id || running.count(member.serverid())) continue;
+      running.insert(member.serverid());
+      std::thread([member, &running, &running_mutex]() {
+        ReplicateTo(member);
+        std::lock_guard<std::mutex> guard(running_mutex);
+        running.erase(member.serverid());
+      }).detach();
+    }
+  }
+}
+
+//Replays a master's mutation on this slave
+void apply_mutation(const peer::Mutation& m){
+  switch(m.op_case()){
+    case peer::Mutation::kLogin: {
+      std::shared_lock<std::shared_mutex> change(change_mutex);
+      std::lock_guard<std::mutex> guard(db_mutex);
+      if(user_ids.find(m.login()) == user_ids.end())
+        add_user(m.login())->connected = false;
+      break;
+    }
+    case peer::Mutation::kFollow:
+      follow_user(m.follow().username(), m.follow().target());
+      break;
+    case peer::Mutation::kUnfollow:
+      unfollow_user(m.unfollow().username(), m.unfollow().target());
+      break;
+    case peer::Mutation::kDeliver:
+      deliver_remote(m.deliver());
+      break;
+    case peer::Mutation::kFollowBatch: {
+      std::vector<std::pair<std::string, std::string>> edges;
+      for(auto& f : m.follow_batch().follows())
+        edges.emplace_back(f.username(), f.target());
+      follow_users(edges, false);
+      break;
+    }
+    case peer::Mutation::kPost: {
+      int user_index = find_user(m.post().username());
+      if(user_index >= 0)
+        post_message(client_db[user_index], m.post());
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+//Replaces a user's files and counters with the master's copy from a
+//snapshot, creating the user if this server hasn't seen them. Their follows
+//are set by apply_snapshot_graph once every user has arrived
+void apply_user_state(const peer::UserState& state){
+  Client* c;
+  {
+    std::lock_guard<std::mutex> guard(db_mutex);
+    auto it = user_ids.find(state.username());
+    if(it != user_ids.end())
+      c = client_db[it->second];
+    else{
+      c = add_user(state.username(), state.remote());
+      c->connected = false;
+    }
+  }
+  c->remote = state.remote();
+  std::lock_guard<std::mutex> guard(c->stream_mutex);
+  {
+    std::lock_guard<std::mutex> file_guard(file_lock(c->timeline_file));
+    std::ofstream(c->timeline_file, std::ios::binary|std::ios::trunc) << state.timeline();
+  }
+  {
+    std::lock_guard<std::mutex> file_guard(file_lock(c->following_file));
+    std::ofstream(c->following_file, std::ios::binary|std::ios::trunc) << state.following_timeline();
+    c->following_base = state.following_base();
+    std::ofstream(c->following_file + ".base", std::ios::trunc) << state.following_base() << "\n";
+  }
+  c->next_seq = state.next_seq();
+  c->following_file_size = state.next_seq() - state.following_base();
+  c->recent.clear();
+  c->inbox.clear();
+}
+
+//Replaces every user's follow lists with those of a snapshot, by username
+void apply_snapshot_graph(const std::unordered_map<std::string, std::vector<std::string>>& following){
+  size_t user_count = client_db.size();
+  for(UserId id = 0; id < user_count; id++){
+    std::lock_guard<std::mutex> guard(client_db[id]->graph_mutex);
+    client_db[id]->client_following.clear();
+    client_db[id]->client_followers.clear();
+  }
+  for(auto& user : following){
+    int user_index = find_user(user.first);
+    if(user_index < 0) continue;
+    for(auto& target : user.second){
+      int target_index = find_user(target);
+      if(target_index < 0 || target_index == user_index) continue;
+      {
+        std::lock_guard<std::mutex> guard(client_db[user_index]->graph_mutex);
+        client_db[user_index]->client_following.push_back(target_index);
       }
-      //Send the message to each follower's stream
-      std::vector<Client*>::const_iterator it;
-      for(it = c->client_followers.begin(); it!=c->client_followers.end(); it++){
-        Client *temp_client = *it;
-      	if(temp_client->stream!=0 && temp_client->connected)
-	  temp_client->stream->Write(message);
-        //For each of the current user's followers, put the message in their following.txt file
-        std::string temp_username = temp_client->username;
-        std::string temp_file = temp_username + "following.txt";
-	std::ofstream following_file(temp_file,std::ios::app|std::ios::out|std::ios::in);
-	following_file << fileinput;
-        temp_client->following_file_size++;
-	std::ofstream user_file(temp_username + ".txt",std::ios::app|std::ios::out|std::ios::in);
-        user_file << fileinput;
+      std::lock_guard<std::mutex> guard(client_db[target_index]->graph_mutex);
+      client_db[target_index]->client_followers.push_back(user_index);
+    }
+  }
+}
+
+class PeerServiceImpl final : public peer::PeerService::Service {
+  //Applies the master's mutations in order, acking once per batch
+  Status Replicate(ServerContext* context, ServerReaderWriter<peer::ReplicationAck, peer::MutationBatch>* stream) override {
+    if(is_master)
+      return Status(grpc::StatusCode::FAILED_PRECONDITION, "this server is the master");
+    //A new master replaces a stream left over from the old one
+    {
+      std::lock_guard<std::mutex> guard(active_mutex);
+      if(active) active->TryCancel();
+    }
+    std::lock_guard<std::mutex> apply_guard(apply_mutex);
+    {
+      std::lock_guard<std::mutex> guard(active_mutex);
+      active = context;
+    }
+    peer::ReplicationAck ack;
+    ack.set_seq(replication_log->last());
+    ack.set_epoch(replication_log->epoch());
+    peer::MutationBatch batch;
+    //Follows of the snapshot being received, applied once it is complete
+    std::unordered_map<std::string, std::vector<std::string>> snapshot_following;
+    if(stream->Write(ack)){
+      while(stream->Read(&batch)){
+        if(batch.snapshot_size() > 0 || batch.snapshot_done()){
+          std::unique_lock<std::shared_mutex> barrier(change_mutex);
+          for(auto& state : batch.snapshot()){
+            apply_user_state(state);
+            auto& following = snapshot_following[state.username()];
+            following.assign(state.following().begin(), state.following().end());
+          }
+          if(!batch.snapshot_done())
+            continue;
+          apply_snapshot_graph(snapshot_following);
+          snapshot_following.clear();
+          replication_log->reset(batch.epoch(), batch.snapshot_seq());
+          log(INFO, "Resynced from the master's snapshot at seq " + std::to_string(batch.snapshot_seq()));
+        }
+        //Mutations only follow on from what was applied here within one log
+        else if(batch.epoch() != replication_log->epoch()){
+          log(WARNING, "Replication stream is on another log than this server, dropping it");
+          break;
+        }
+        for(auto& m : batch.mutations()){
+          if(m.seq() <= replication_log->last()) continue;
+          apply_mutation(m);
+          replication_log->applied(m.seq());
+        }
+        ack.set_seq(replication_log->last());
+        ack.set_epoch(replication_log->epoch());
+        if(!stream->Write(ack)) break;
       }
     }
-    //If the client disconnected from Chat Mode, set connected to false
-    c->connected = false;
+    std::lock_guard<std::mutex> guard(active_mutex);
+    if(active == context) active = nullptr;
     return Status::OK;
   }
 
+  //Hands posts from another cluster's synchronizer to their followers here
+  Status DeliverBatch(ServerContext* context, const peer::DeliveryBatch* batch, peer::DeliveryAck* ack) override {
+    if(!is_master)
+      return Status(grpc::StatusCode::FAILED_PRECONDITION, "this server is not the master");
+    int delivered = 0;
+    int64_t now_ms = google::protobuf::util::TimeUtil::TimestampToMilliseconds(
+        google::protobuf::util::TimeUtil::GetCurrentTime());
+    for(auto& delivery : batch->deliveries()){
+      delivered += deliver_remote(delivery);
+      remote_posts++;
+      remote_latency_ms += now_ms - google::protobuf::util::TimeUtil::TimestampToMilliseconds(delivery.post().timestamp());
+    }
+    ack->set_delivered(delivered);
+    return Status::OK;
+  }
+
+  std::mutex apply_mutex;
+  std::mutex active_mutex;
+  ServerContext* active = nullptr;
 };
 
+//Moves heartbeats to the leader a coordinator named in its reply, or else to
+//the next coordinator of the group
+void switchCoordinator(grpc::ClientContext& context) {
+    if (coordinators.size() < 2) return;
+    auto& trailers = context.GetServerTrailingMetadata();
+    auto hint = trailers.find("coordinator-leader");
+    size_t next = (current_coordinator + 1) % coordinators.size();
+    if (hint != trailers.end()) {
+        std::string leader(hint->second.data(), hint->second.size());
+        auto it = std::find(coordinators.begin(), coordinators.end(), leader);
+        if (it != coordinators.end()) next = it - coordinators.begin();
+    }
+    if (next == current_coordinator) return;
+    current_coordinator = next;
+    log(INFO, "Sending heartbeats to coordinator " + coordinators[next]);
+    stub_ = CoordService::NewStub(grpc::CreateChannel(coordinators[next], grpc::InsecureChannelCredentials()));
+}
+
+//Sends heartbeats over a long-lived stream and applies the commands that come back.
+//Falls back to unary Heartbeat calls if the coordinator doesn't offer the stream.
 void KeepAlive(int clusterId, int serverId, const std::string& hostName, const std::string& portNumber) {
+    ServerInfo heartbeat;
+    heartbeat.set_clusterid(clusterId);
+    heartbeat.set_serverid(serverId);
+    heartbeat.set_hostname(hostName);
+    heartbeat.set_port(portNumber);
+    heartbeat.set_type("Active");
+    bool streaming = true;
+    bool heartbeat_ok = false;
     while (true) {
-        grpc::ClientContext context;
-        ServerInfo serverDetails;
-        Confirmation heartbeatConfirmation;
-        
-        serverDetails.set_clusterid(clusterId);
-        serverDetails.set_serverid(serverId);
-        serverDetails.set_hostname(hostName);
-        serverDetails.set_port(portNumber);
-        serverDetails.set_type("Active");
-
-        auto heartbeatStatus = stub_->Heartbeat(&context, serverDetails, &heartbeatConfirmation);
-        if (heartbeatStatus.ok()) {
-            log(INFO, "Successfully sent heartbeat");
+        grpc::Status heartbeatStatus;
+        if (streaming) {
+            grpc::ClientContext context;
+            std::shared_ptr<grpc::ClientReaderWriter<ServerInfo, CoordCommand>> stream(
+                stub_->HeartbeatStream(&context));
+            std::thread reader([stream]() {
+                CoordCommand cmd;
+                while (stream->Read(&cmd)) {
+                    handle_command(cmd);
+                }
+            });
+            while (stream->Write(heartbeat)) {
+                if (!heartbeat_ok) {
+                    heartbeat_ok = true;
+                    log(INFO, "Heartbeat stream to coordinator established");
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(heartbeat_interval_ms));
+            }
+            context.TryCancel();
+            reader.join();
+            heartbeatStatus = stream->Finish();
+            if (heartbeatStatus.error_code() == grpc::StatusCode::UNIMPLEMENTED) {
+                log(WARNING, "Coordinator has no heartbeat stream, using unary heartbeats");
+                streaming = false;
+                continue;
+            }
+            if (!heartbeatStatus.ok()) switchCoordinator(context);
         } else {
-            log(ERROR, "Heartbeat failed");
+            grpc::ClientContext context;
+            Confirmation heartbeatConfirmation;
+            heartbeatStatus = stub_->Heartbeat(&context, heartbeat, &heartbeatConfirmation);
+            if (!heartbeatStatus.ok()) switchCoordinator(context);
+        }
+
+        //Only changes in heartbeat health are logged; beats are too frequent to log each one
+        if (heartbeatStatus.ok() != heartbeat_ok) {
+            heartbeat_ok = heartbeatStatus.ok();
+            if (heartbeat_ok) {
+                log(INFO, "Successfully sent heartbeat");
+            } else {
+                log(ERROR, "Heartbeat failed: " + heartbeatStatus.error_message());
+            }
         }
         
-        sleep(3);
+        std::this_thread::sleep_for(std::chrono::milliseconds(heartbeat_interval_ms));
     }
 }
 
 void RunServer(int cluster_id, int server_id, std::string coordinator_ip, std::string coordinator_port, std::string port_no) {
   std::string server_address = "0.0.0.0:"+port_no;
   SNSServiceImpl service;
+  SNSServiceV2Impl service_v2;
+  PeerServiceImpl peer_service;
 
   ServerBuilder builder;
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
+  //Snapshots for resyncing this server as a slave come in large batches
+  builder.SetMaxReceiveMessageSize(SNAPSHOT_MAX_MESSAGE);
   builder.RegisterService(&service);
+  builder.RegisterService(&service_v2);
+  builder.RegisterService(&peer_service);
   std::unique_ptr<Server> server(builder.BuildAndStart());
   std::cout << "Server listening on " << server_address << std::endl;
   log(INFO, "Server listening on "+server_address);
 
-  std::string login_info = coordinator_ip + ":" + coordinator_port;
+  std::stringstream ports(coordinator_port);
+  std::string coordinator;
+  while (std::getline(ports, coordinator, ',')) {
+    if (!coordinator.empty()) coordinators.push_back(coordinator_ip + ":" + coordinator);
+  }
+  std::string login_info = coordinators.empty() ? coordinator_ip + ":" + coordinator_port : coordinators[0];
   stub_ = std::unique_ptr<CoordService::Stub>(CoordService::NewStub(
             grpc::CreateChannel(
               login_info, grpc::InsecureChannelCredentials())));
 
   std::thread hb(KeepAlive, cluster_id, server_id, "0.0.0.0", port_no);
 
+  std::thread stats(ReportStats);
+
+  std::thread replication(ManageReplication, server_id);
+
+  std::thread compactor;
+  if(retention.max_posts > 0 || retention.max_days > 0){
+    log(INFO, "Timeline retention: last " + std::to_string(retention.max_posts) + " posts, "
+        + std::to_string(retention.max_days) + " days, compacting every "
+        + std::to_string(retention.interval_secs) + " s");
+    compactor = std::thread(CompactTimelines);
+  }
+
   server->Wait();
 }
 
@@ -321,7 +2030,7 @@ int main(int argc, char** argv) {
   std::string port = "3011";
   
   int opt = 0;
-  while ((opt = getopt(argc, argv, "c:s:h:k:p:")) != -1){
+  while ((opt = getopt(argc, argv, "c:s:h:k:p:n:a:z:l:b:i:d:r:w:o:e:y:")) != -1){
     switch(opt) {
       case 'c':
         cluster_id = atoi(optarg);
@@ -338,6 +2047,42 @@ int main(int argc, char** argv) {
       case 'p':
         port = optarg;
         break;
+      case 'n':
+        retention.max_posts = atoi(optarg);
+        break;
+      case 'a':
+        retention.max_days = atoi(optarg);
+        break;
+      case 'z':
+        retention.interval_secs = std::max(1, atoi(optarg));
+        break;
+      case 'l':
+        batching.linger_ms = atoi(optarg);
+        break;
+      case 'b':
+        batching.max_batch = std::max(1, atoi(optarg));
+        break;
+      case 'i':
+        heartbeat_interval_ms = std::max(1, atoi(optarg));
+        break;
+      case 'd':
+        data_dir = optarg;
+        break;
+      case 'r':
+        replication_buffer = std::max(1, atoi(optarg));
+        break;
+      case 'w':
+        replication_window = std::max(1, atoi(optarg));
+        break;
+      case 'o':
+        offline.max_posts = std::max(1, atoi(optarg));
+        break;
+      case 'e':
+        offline.catchup_batch = std::max(1, atoi(optarg));
+        break;
+      case 'y':
+        offline.catchup_interval_ms = atoi(optarg);
+        break;
       default:
 	      std::cerr << "Invalid Command Line Argument\n";
     }
@@ -346,6 +2091,7 @@ int main(int argc, char** argv) {
   std::string log_file_name = std::string("server-") + port;
   google::InitGoogleLogging(log_file_name.c_str());
   log(INFO, "Logging Initialized. Server starting...");
+  replication_log = new ReplicationLog(replication_buffer);
   RunServer(cluster_id, server_id, coordinator_ip, coordinator_port, port);
 
   return 0;
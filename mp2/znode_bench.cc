@@ -0,0 +1,148 @@
+// Benchmarks master election on the coordinator's znode store.
+//
+// Every cluster runs the ZooKeeper election recipe over and over: each of its
+// servers creates an ephemeral sequential node under /election/<cluster>,
+// the lowest one is master and every other server watches its predecessor.
+// The master's session is then closed, which must hand mastership to the
+// next server through its watch. Reader threads meanwhile look up masters
+// the way GetServer would.
+//
+//   ./znode_bench -c 1000 -s 3 -t 4 -r 4 -d 10
+//
+// -c clusters, -s servers per cluster, -t writer threads, -r reader threads,
+// -d duration in seconds.
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "znode_store.h"
+
+int main(int argc, char** argv) {
+    int num_clusters = 1000;
+    int num_servers = 3;
+    int num_writers = 4;
+    int num_readers = 4;
+    int duration_secs = 10;
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "c:s:t:r:d:")) != -1){
+        switch(opt) {
+            case 'c':
+                num_clusters = atoi(optarg);
+                break;
+            case 's':
+                num_servers = atoi(optarg);
+                break;
+            case 't':
+                num_writers = atoi(optarg);
+                break;
+            case 'r':
+                num_readers = atoi(optarg);
+                break;
+            case 'd':
+                duration_secs = atoi(optarg);
+                break;
+            default:
+                std::cerr << "Invalid Command Line Argument\n";
+        }
+    }
+    if (num_clusters <= 0 || num_servers < 2 || num_writers <= 0) {
+        std::cerr << "Need at least one cluster, two servers per cluster and one writer\n";
+        return 1;
+    }
+
+    ZnodeStore store;
+    store.create("/election", "");
+    for (int c = 0; c < num_clusters; c++) {
+        store.create("/election/" + std::to_string(c), "");
+    }
+
+    std::atomic<bool> done{false};
+    std::atomic<long> writes{0}, reads{0}, elections{0}, failovers{0};
+    std::vector<std::thread> threads;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < num_writers; t++) {
+        threads.emplace_back([&, t]() {
+            // sessions are never reused, like real heartbeat sessions
+            ZnodeStore::SessionId next_session = (static_cast<uint64_t>(t) << 40) + 1;
+            while (!done) {
+                for (int c = t; c < num_clusters && !done; c += num_writers) {
+                    std::string dir = "/election/" + std::to_string(c);
+                    std::vector<ZnodeStore::SessionId> sessions;
+                    std::vector<std::string> nodes;
+                    for (int s = 0; s < num_servers; s++) {
+                        std::string created;
+                        sessions.push_back(next_session++);
+                        store.create(dir + "/n_", "127.0.0.1:" + std::to_string(10000 + s),
+                                     sessions.back(), true, &created);
+                        nodes.push_back(created);
+                        writes++;
+                    }
+
+                    // sequence numbers are zero padded, so the sorted children
+                    // are in creation order and the first one is master
+                    std::vector<std::string> candidates;
+                    store.children(dir, &candidates);
+                    reads++;
+                    elections++;
+
+                    // the runner-up takes over when the master's node goes away
+                    std::atomic<bool> promoted{false};
+                    store.watch(nodes[0], [&](const std::string&, ZnodeStore::Event event) {
+                        std::vector<std::string> now;
+                        store.children(dir, &now);
+                        if (event == ZnodeStore::DELETED && !now.empty() && dir + "/" + now[0] == nodes[1]) {
+                            promoted = true;
+                        }
+                    });
+                    store.closeSession(sessions[0]);
+                    writes++;
+                    if (promoted) {
+                        failovers++;
+                        elections++;
+                    }
+
+                    for (size_t s = 1; s < sessions.size(); s++) {
+                        store.closeSession(sessions[s]);
+                        writes++;
+                    }
+                }
+            }
+        });
+    }
+    for (int t = 0; t < num_readers; t++) {
+        threads.emplace_back([&, t]() {
+            std::vector<std::string> candidates;
+            std::string data;
+            long n = 0;
+            for (int c = t; !done; c = (c + 1) % num_clusters) {
+                std::string dir = "/election/" + std::to_string(c);
+                if (store.children(dir, &candidates) && !candidates.empty()) {
+                    store.get(dir + "/" + candidates[0], &data);
+                }
+                n++;
+            }
+            reads += n;
+        });
+    }
+
+    sleep(duration_secs);
+    done = true;
+    for (auto& t : threads) t.join();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << num_clusters << " clusters x " << num_servers << " servers, "
+              << num_writers << " writers, " << num_readers << " readers, " << elapsed << " s" << std::endl;
+    std::cout << "writes: " << static_cast<long>(writes / elapsed) << " ops/s" << std::endl;
+    std::cout << "reads: " << static_cast<long>(reads / elapsed) << " ops/s" << std::endl;
+    std::cout << "elections: " << static_cast<long>(elections / elapsed) << "/s ("
+              << failovers << " failovers through watches)" << std::endl;
+    return failovers > 0 ? 0 : 1;
+}
@@ -0,0 +1,317 @@
+#ifndef ZNODE_STORE_H
+#define ZNODE_STORE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// ZooKeeper-style tree of znodes addressed by absolute paths like
+// "/election/3/n_0000000007".
+//
+// The tree is immutable and published through an atomic shared_ptr: a write
+// copies the nodes on the path from the root to the changed node and swaps
+// in the new root under the writer mutex, so exists/get/children only load
+// the current root and never wait on writers. A write costs one copy of each
+// ancestor's child list.
+//
+// Ephemeral nodes belong to a session (a server's heartbeat session in the
+// coordinator) and are deleted when the session closes. Sequential nodes get
+// the parent's next sequence number appended to their name. Watches are
+// one-shot, as in ZooKeeper, and fire when the watched path is created or
+// deleted.
+class ZnodeStore {
+public:
+    enum Result { OK, NODE_EXISTS, NO_NODE, NO_PARENT, NOT_EMPTY, EPHEMERAL_PARENT, BAD_PATH };
+    enum Event { CREATED, DELETED };
+
+    // 0 means a persistent node
+    typedef uint64_t SessionId;
+    typedef std::function<void(const std::string& path, Event event)> Watcher;
+
+    ZnodeStore() : root(std::make_shared<const Node>()) {}
+
+    // creates `path`, whose parent must exist. with `sequential` the node's
+    // name gets a ten digit suffix, and the name actually used goes to `created`
+    Result create(const std::string& path, const std::string& data,
+                  SessionId owner = 0, bool sequential = false, std::string* created = nullptr) {
+        std::vector<std::string> parts;
+        if (!split(path, &parts) || parts.empty()) return BAD_PATH;
+        std::vector<Watcher> fired;
+        std::string name;
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            std::vector<NodePtr> chain;
+            if (!walk(std::atomic_load(&root), parts, parts.size() - 1, &chain)) return NO_PARENT;
+            const NodePtr& parent = chain.back();
+            if (parent->owner) return EPHEMERAL_PARENT;
+
+            std::string leaf = parts.back();
+            if (sequential) {
+                char suffix[16];
+                snprintf(suffix, sizeof(suffix), "%010llu", static_cast<unsigned long long>(parent->cversion));
+                leaf += suffix;
+            }
+            auto pos = parent->lowerBound(leaf);
+            if (pos != parent->children.end() && pos->first == leaf) return NODE_EXISTS;
+
+            auto node = std::make_shared<Node>();
+            node->data = data;
+            node->owner = owner;
+            auto updated = std::make_shared<Node>(*parent);
+            updated->cversion++;
+            updated->children.emplace(updated->children.begin() + (pos - parent->children.begin()), leaf, node);
+            parts.back() = leaf;
+            publish(chain, parts, updated);
+
+            name = join(parts);
+            if (owner) sessions[owner].insert(name);
+            take(name, &fired);
+        }
+        if (created) *created = name;
+        for (auto& w : fired) w(name, CREATED);
+        return OK;
+    }
+
+    // deletes a node without children
+    Result remove(const std::string& path) {
+        std::vector<Watcher> fired;
+        std::string name;
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            Result r = removeLocked(path, &name, &fired);
+            if (r != OK) return r;
+        }
+        for (auto& w : fired) w(name, DELETED);
+        return OK;
+    }
+
+    // deletes every ephemeral node the session created
+    void closeSession(SessionId owner) {
+        std::vector<std::pair<std::string, std::vector<Watcher>>> fired;
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            auto it = sessions.find(owner);
+            if (it == sessions.end()) return;
+            std::set<std::string> paths = it->second;
+            for (auto& path : paths) {
+                fired.emplace_back(std::string(), std::vector<Watcher>());
+                removeLocked(path, &fired.back().first, &fired.back().second);
+            }
+        }
+        for (auto& f : fired) {
+            for (auto& w : f.second) w(f.first, DELETED);
+        }
+    }
+
+    bool exists(const std::string& path) const {
+        return find(path) != nullptr;
+    }
+
+    bool get(const std::string& path, std::string* data) const {
+        NodePtr node = find(path);
+        if (!node) return false;
+        *data = node->data;
+        return true;
+    }
+
+    // child names in sorted order, so sequential nodes come out oldest first
+    bool children(const std::string& path, std::vector<std::string>* names) const {
+        NodePtr node = find(path);
+        if (!node) return false;
+        names->clear();
+        for (auto& child : node->children) names->push_back(child.first);
+        return true;
+    }
+
+    // a node as saved in a snapshot
+    struct Entry {
+        std::string path;
+        std::string data;
+        SessionId owner;
+        uint64_t cversion;
+    };
+
+    // every node but the root, parents before their children
+    std::vector<Entry> dump() const {
+        std::vector<Entry> entries;
+        dumpNode(std::atomic_load(&root), "", &entries);
+        return entries;
+    }
+
+    // re-creates a dumped node, keeping its sequence counter. no watches fire
+    Result restore(const Entry& entry) {
+        std::vector<std::string> parts;
+        if (!split(entry.path, &parts) || parts.empty()) return BAD_PATH;
+        std::lock_guard<std::mutex> lock(mu);
+        std::vector<NodePtr> chain;
+        if (!walk(std::atomic_load(&root), parts, parts.size() - 1, &chain)) return NO_PARENT;
+        auto pos = chain.back()->lowerBound(parts.back());
+        if (pos != chain.back()->children.end() && pos->first == parts.back()) return NODE_EXISTS;
+
+        auto node = std::make_shared<Node>();
+        node->data = entry.data;
+        node->owner = entry.owner;
+        node->cversion = entry.cversion;
+        auto updated = std::make_shared<Node>(*chain.back());
+        updated->children.emplace(updated->children.begin() + (pos - chain.back()->children.begin()), parts.back(), node);
+        publish(chain, parts, updated);
+        if (entry.owner) sessions[entry.owner].insert(join(parts));
+        return OK;
+    }
+
+    // drops every node, session and watch
+    void clear() {
+        std::lock_guard<std::mutex> lock(mu);
+        std::atomic_store(&root, std::make_shared<const Node>());
+        sessions.clear();
+        watches.clear();
+    }
+
+    // registers a one-shot watch on `path` and returns whether it exists.
+    // the check and the registration are atomic, so no change is missed
+    bool watch(const std::string& path, Watcher watcher) {
+        std::lock_guard<std::mutex> lock(mu);
+        watches[normalize(path)].push_back(std::move(watcher));
+        return find(path) != nullptr;
+    }
+
+private:
+    struct Node;
+    typedef std::shared_ptr<const Node> NodePtr;
+    struct Node {
+        std::string data;
+        SessionId owner = 0;
+        // next sequence number for sequential children
+        uint64_t cversion = 0;
+        // sorted by name. a flat vector is copied with one allocation, which
+        // keeps writes cheap under directories with thousands of children
+        std::vector<std::pair<std::string, NodePtr>> children;
+
+        std::vector<std::pair<std::string, NodePtr>>::const_iterator lowerBound(const std::string& name) const {
+            return std::lower_bound(children.begin(), children.end(), name,
+                [](const std::pair<std::string, NodePtr>& child, const std::string& n) { return child.first < n; });
+        }
+
+        NodePtr child(const std::string& name) const {
+            auto it = lowerBound(name);
+            return it != children.end() && it->first == name ? it->second : nullptr;
+        }
+    };
+
+    static void dumpNode(const NodePtr& node, const std::string& path, std::vector<Entry>* entries) {
+        for (auto& child : node->children) {
+            std::string childPath = path + "/" + child.first;
+            entries->push_back(Entry{childPath, child.second->data, child.second->owner, child.second->cversion});
+            dumpNode(child.second, childPath, entries);
+        }
+    }
+
+    static bool split(const std::string& path, std::vector<std::string>* parts) {
+        if (path.empty() || path[0] != '/') return false;
+        size_t start = 1;
+        while (start < path.size()) {
+            size_t end = path.find('/', start);
+            if (end == std::string::npos) end = path.size();
+            if (end == start) return false;
+            parts->push_back(path.substr(start, end - start));
+            start = end + 1;
+        }
+        // "/" is the root, "/a/" is malformed
+        return path.size() == 1 || path.back() != '/';
+    }
+
+    static std::string join(const std::vector<std::string>& parts) {
+        std::string path;
+        for (auto& p : parts) path += "/" + p;
+        return path.empty() ? "/" : path;
+    }
+
+    static std::string normalize(const std::string& path) {
+        std::vector<std::string> parts;
+        return split(path, &parts) ? join(parts) : path;
+    }
+
+    // collects the nodes from the root down to depth `depth` of `parts`
+    static bool walk(NodePtr node, const std::vector<std::string>& parts, size_t depth, std::vector<NodePtr>* chain) {
+        chain->push_back(node);
+        for (size_t i = 0; i < depth; i++) {
+            node = node->child(parts[i]);
+            if (!node) return false;
+            chain->push_back(node);
+        }
+        return true;
+    }
+
+    NodePtr find(const std::string& path) const {
+        std::vector<std::string> parts;
+        if (!split(path, &parts)) return nullptr;
+        NodePtr node = std::atomic_load(&root);
+        for (auto& p : parts) {
+            node = node->child(p);
+            if (!node) return nullptr;
+        }
+        return node;
+    }
+
+    // replaces chain.back() with `updated` by copying its ancestors, then
+    // publishes the new root. must be called with mu held
+    void publish(const std::vector<NodePtr>& chain, const std::vector<std::string>& parts, std::shared_ptr<Node> updated) {
+        for (size_t i = chain.size() - 1; i > 0; i--) {
+            auto parent = std::make_shared<Node>(*chain[i - 1]);
+            auto pos = chain[i - 1]->lowerBound(parts[i - 1]);
+            parent->children[pos - chain[i - 1]->children.begin()].second = updated;
+            updated = parent;
+        }
+        std::atomic_store(&root, NodePtr(updated));
+    }
+
+    // moves the watches on `path` into `fired`. must be called with mu held
+    void take(const std::string& path, std::vector<Watcher>* fired) {
+        auto it = watches.find(path);
+        if (it == watches.end()) return;
+        *fired = std::move(it->second);
+        watches.erase(it);
+    }
+
+    Result removeLocked(const std::string& path, std::string* name, std::vector<Watcher>* fired) {
+        std::vector<std::string> parts;
+        if (!split(path, &parts) || parts.empty()) return BAD_PATH;
+        std::vector<NodePtr> chain;
+        if (!walk(std::atomic_load(&root), parts, parts.size(), &chain)) return NO_NODE;
+        NodePtr node = chain.back();
+        if (!node->children.empty()) return NOT_EMPTY;
+        chain.pop_back();
+
+        auto updated = std::make_shared<Node>(*chain.back());
+        auto pos = chain.back()->lowerBound(parts.back());
+        updated->children.erase(updated->children.begin() + (pos - chain.back()->children.begin()));
+        parts.pop_back();
+        publish(chain, parts, updated);
+
+        *name = normalize(path);
+        if (node->owner) {
+            auto s = sessions.find(node->owner);
+            s->second.erase(*name);
+            if (s->second.empty()) sessions.erase(s);
+        }
+        take(*name, fired);
+        return OK;
+    }
+
+    std::mutex mu;
+    NodePtr root;
+    // ephemeral paths by owning session
+    std::unordered_map<SessionId, std::set<std::string>> sessions;
+    std::unordered_map<std::string, std::vector<Watcher>> watches;
+};
+
+#endif